@@ -0,0 +1,207 @@
+#ifndef PROTO_RPC_CAPTURE
+#define PROTO_RPC_CAPTURE
+
+#include <errno.h>
+#include <fcntl.h>    // for open
+#include <sys/mman.h> // for mmap
+#include <unistd.h>   // for ftruncate, close
+
+#include <cstddef>
+#include <cstring> // for memcpy
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/stubs/common.h> // for uint64
+
+#include <proto_rpc/namespace.hpp>
+#include <proto_rpc/tracing.hpp> // for monotonicNanoseconds
+
+namespace proto_rpc {
+
+/*
+* capture file layout (host byte order)
+*   header: magic (8 bytes), descriptor size (uint32), serialized ServiceDescriptorProto
+*   records: each aligned to 8 bytes
+*     timestamp (uint64, monotonic ns, 0 terminates records), connection (uint64),
+*     method index (int32, -1 if invalid), request size (uint32), flags (uint32, 1 if one-way),
+*     padding (uint32), request attachment size (uint64), encoded request
+*   the bytes of request attachments are not captured
+*/
+
+struct CaptureRecord {
+  static bool earlier(const CaptureRecord &a, const CaptureRecord &b) {
+    return a.timestamp < b.timestamp;
+  }
+
+  gp::uint64 timestamp;
+  gp::uint64 connection;
+  gp::int32 method_index;
+  bool one_way;
+  gp::uint64 attachment_size;
+  std::string request; // the request with its length prefix, as received
+};
+
+// memory-mapped, append-only log of received requests. appending is safe from multiple threads.
+class CaptureFile : boost::noncopyable {
+public:
+  CaptureFile(const std::string &path, const std::size_t capacity,
+              const gp::ServiceDescriptor *service)
+      : fd_(-1), data_(NULL), capacity_(capacity), size_(0), connections_(0), dropped_(0) {
+    // serialize the header
+    std::string header(magic(), MAGIC_SIZE);
+    {
+      gp::ServiceDescriptorProto descriptor;
+      service->CopyTo(&descriptor);
+      const std::string bytes(descriptor.SerializeAsString());
+      const gp::uint32 size(bytes.size());
+      header.append(reinterpret_cast< const char * >(&size), sizeof(size));
+      header.append(bytes);
+    }
+    header.resize(align(header.size()), '\0');
+    if (header.size() > capacity_) {
+      throw bs::system_error(bs::error_code(ENOSPC, bs::system_category()),
+                             "Too small capture capacity");
+    }
+
+    // map the whole capacity of the file
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0) {
+      throw bs::system_error(bs::error_code(errno, bs::system_category()), path);
+    }
+    if (ftruncate(fd_, capacity_) != 0) {
+      const int error(errno);
+      close(fd_);
+      throw bs::system_error(bs::error_code(error, bs::system_category()), path);
+    }
+    void *const data(mmap(NULL, capacity_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0));
+    if (data == MAP_FAILED) {
+      const int error(errno);
+      close(fd_);
+      throw bs::system_error(bs::error_code(error, bs::system_category()), path);
+    }
+    data_ = static_cast< char * >(data);
+
+    std::memcpy(data_, header.data(), header.size());
+    size_ = header.size();
+  }
+
+  virtual ~CaptureFile() {
+    // shrink the file to the captured records
+    munmap(data_, capacity_);
+    if (ftruncate(fd_, size_) != 0) {
+      // trailing zeros are left, which also terminate records
+      std::cerr << "Error on shrinking capture file: " << std::strerror(errno) << std::endl;
+    }
+    close(fd_);
+  }
+
+  // an id for a new connection
+  gp::uint64 newConnection() { return ++connections_; }
+
+  // append a request. the request is dropped if the capacity is exhausted.
+  void append(const gp::uint64 connection, const gp::int32 method_index, const bool one_way,
+              const gp::uint64 attachment_size, const char *request,
+              const std::size_t request_size) {
+    const std::size_t record_size(align(RECORD_HEADER_SIZE + request_size));
+
+    // reserve a range for the record. the size only grows to a range within the capacity, so a
+    // dropped record never leaves a gap or an overlap for others.
+    std::size_t offset(size_.load());
+    do {
+      if (offset + record_size > capacity_) {
+        ++dropped_;
+        return;
+      }
+    } while (!size_.compare_exchange_weak(offset, offset + record_size));
+
+    // fill the range. the timestamp is written last so a record cut by a crash reads as the end.
+    char *const record(data_ + offset);
+    const gp::uint32 size(request_size), flags(one_way ? 1 : 0);
+    std::memcpy(record + 8, &connection, 8);
+    std::memcpy(record + 16, &method_index, 4);
+    std::memcpy(record + 20, &size, 4);
+    std::memcpy(record + 24, &flags, 4);
+    std::memcpy(record + 32, &attachment_size, 8);
+    std::memcpy(record + RECORD_HEADER_SIZE, request, request_size);
+    const gp::uint64 timestamp(monotonicNanoseconds());
+    std::memcpy(record, &timestamp, 8);
+  }
+
+  std::size_t dropped() const { return dropped_; }
+
+  // read a capture file written by this class
+  static void read(const std::string &path, gp::ServiceDescriptorProto &descriptor,
+                   std::vector< CaptureRecord > &records) {
+    std::ifstream ifs(path.c_str(), std::ios::binary);
+    if (!ifs) {
+      throw bs::system_error(bs::error_code(ENOENT, bs::system_category()), path);
+    }
+
+    // read the header
+    char magic[MAGIC_SIZE];
+    gp::uint32 size;
+    if (!ifs.read(magic, MAGIC_SIZE) || std::memcmp(magic, CaptureFile::magic(), MAGIC_SIZE) != 0 ||
+        !ifs.read(reinterpret_cast< char * >(&size), sizeof(size))) {
+      throw bs::system_error(bs::error_code(EINVAL, bs::system_category()), path);
+    }
+    std::string bytes(size, '\0');
+    if (!ifs.read(&bytes[0], size) || !descriptor.ParseFromString(bytes)) {
+      throw bs::system_error(bs::error_code(EINVAL, bs::system_category()), path);
+    }
+    ifs.seekg(align(MAGIC_SIZE + sizeof(size) + size));
+
+    // read records until the terminator or the end of the file
+    records.clear();
+    while (true) {
+      char header[RECORD_HEADER_SIZE];
+      if (!ifs.read(header, RECORD_HEADER_SIZE)) {
+        break;
+      }
+      CaptureRecord record;
+      gp::uint32 request_size, flags;
+      std::memcpy(&record.timestamp, header, 8);
+      std::memcpy(&record.connection, header + 8, 8);
+      std::memcpy(&record.method_index, header + 16, 4);
+      std::memcpy(&request_size, header + 20, 4);
+      std::memcpy(&flags, header + 24, 4);
+      std::memcpy(&record.attachment_size, header + 32, 8);
+      record.one_way = (flags & 1) != 0;
+      if (record.timestamp == 0) {
+        break;
+      }
+      record.request.resize(request_size);
+      if (request_size > 0 && !ifs.read(&record.request[0], request_size)) {
+        break;
+      }
+      ifs.ignore(align(RECORD_HEADER_SIZE + request_size) - RECORD_HEADER_SIZE - request_size);
+      records.push_back(record);
+    }
+  }
+
+private:
+  enum { MAGIC_SIZE = 8, RECORD_HEADER_SIZE = 40 };
+
+  static const char *magic() { return "PRPCCAP3"; }
+
+  static std::size_t align(const std::size_t size) { return (size + 7) & ~std::size_t(7); }
+
+private:
+  int fd_;
+  char *data_;
+  const std::size_t capacity_;
+  boost::atomic< std::size_t > size_;
+  boost::atomic< gp::uint64 > connections_;
+  boost::atomic< std::size_t > dropped_;
+};
+}
+
+#endif // PROTO_RPC_CAPTURE
\ No newline at end of file
@@ -1,12 +1,19 @@
 #ifndef PROTO_RPC_CHANNEL
 #define PROTO_RPC_CHANNEL
 
+#include <algorithm> // for min
+#include <cstring>   // for memcpy
 #include <iostream>
+#include <set>
 #include <stdexcept>
+#include <string>
 
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/asio/write.hpp>
@@ -27,22 +34,56 @@
 #include <proto_rpc/message_coding.hpp>
 #include <proto_rpc/namespace.hpp>
 #include <proto_rpc/messages.hpp>
+#include <proto_rpc/tracing.hpp>
 
 namespace proto_rpc {
 
 class Channel : public gp::RpcChannel {
 public:
-  enum { DEFAULT_TIMEOUT = 5000 };
+  enum { DEFAULT_TIMEOUT = 5000, DEFAULT_MAX_ATTACHMENT_SIZE = 256 * 1024 * 1024 };
 
 public:
   Channel(const ba::ip::address_v4 &address, const unsigned short port,
           const bp::time_duration &timeout = bp::milliseconds(DEFAULT_TIMEOUT))
-      : endpoint_(address, port), timeout_(timeout), socket_(queue_), timer_(queue_) {}
+      : endpoint_(address, port), timeout_(timeout), socket_(queue_), timer_(queue_),
+        tracing_(false), max_attachment_size_(DEFAULT_MAX_ATTACHMENT_SIZE) {}
 
   virtual ~Channel() {}
 
+  // record stages of each call to TraceBuffer::local() of the calling thread
+  void setTracing(const bool tracing) { tracing_ = tracing; }
+
+  // fail a call whose response attachment is larger than this and close the connection
+  void setMaxAttachmentSize(const std::size_t size) { max_attachment_size_ = size; }
+
+  // calls of a one-way method return once the request is written without waiting the result.
+  // the response and the controller are not updated except for a failure on writing.
+  // a one-way call is sent on a new connection if the server has told that it is closing the
+  // session (e.g. on drain), but may be lost silently if the server starts closing after that.
+  void setOneWay(const gp::MethodDescriptor *method, const bool one_way = true) {
+    if (one_way) {
+      one_way_methods_.insert(method);
+    } else {
+      one_way_methods_.erase(method);
+    }
+  }
+
   void CallMethod(const gp::MethodDescriptor *method, gp::RpcController *controller,
                   const gp::Message *request, gp::Message *response, gp::Closure *done) {
+    callMethod(method, controller, request, response, done);
+  }
+
+  // same as CallMethod() but with a serialized request and response, which are neither parsed
+  // nor checked on this channel
+  void CallMethodRaw(const gp::MethodDescriptor *method, gp::RpcController *controller,
+                     const std::string *request, std::string *response, gp::Closure *done) {
+    callMethod(method, controller, request, response, done);
+  }
+
+private:
+  template < typename Request, typename Response >
+  void callMethod(const gp::MethodDescriptor *method, gp::RpcController *controller,
+                  const Request *request, Response *response, gp::Closure *done) {
     // ensure a controller and a closure exist
     boost::scoped_ptr< gp::RpcController > _controller;
     if (!controller) {
@@ -53,6 +94,14 @@ public:
       // Note: this closure deletes itself when Run() is called
       done = gp::NewCallback(&gp::DoNothing);
     }
+    // attachments and trace ids are available only via our controller
+    Controller *const rpc_controller(dynamic_cast< Controller * >(controller));
+
+    // start tracing this call if enabled
+    TraceRecord trace;
+    if (tracing_) {
+      trace.stamp(TraceRecord::CLIENT_CALL_START);
+    }
 
     try {
       // check inputs
@@ -65,46 +114,107 @@ public:
       if (!response) {
         throw std::runtime_error("Null response");
       }
-      if (!request->IsInitialized()) {
+      if (!isInitialized(*request)) {
         throw std::runtime_error("Uninitialized request");
       }
 
-      // connect to the server if not connected
-      if (!socket_.is_open()) {
-        connect();
-        std::cout << "Connected to a server at " << endpoint_ << std::endl;
+      // send the request and receive the failure info. a closing session on the server tells
+      // that the request has not been processed (e.g. on drain), so the request is sent once
+      // again on a new connection.
+      FailureInfo info;
+      for (int attempt = 0;; ++attempt) {
+        // a one-way call reads nothing from the server, so it checks a closing info received
+        // after the previous call before sending the request on the closing session
+        if (socket_.is_open() && one_way_methods_.count(method) > 0 && closingReceived()) {
+          socket_.close();
+        }
 
-        // send the service description to the sever once connected
-        {
-          gp::ServiceDescriptorProto descriptor;
-          method->service()->CopyTo(&descriptor);
-          write(descriptor);
+        // connect to the server if not connected
+        if (!socket_.is_open()) {
+          connect();
+          read_buffer_.consume(read_buffer_.size());
+          std::cout << "Connected to a server at " << endpoint_ << std::endl;
+
+          // send the service description to the sever once connected
+          {
+            gp::ServiceDescriptorProto descriptor;
+            method->service()->CopyTo(&descriptor);
+            write(descriptor);
+          }
+
+          // receive a match result against a description the server has
+          FailureInfo match;
+          read_buffer_.consume(read(read_buffer_, match));
+
+          // check the match result
+          if (!match.IsInitialized()) {
+            throw std::runtime_error("Uninitialized failure info");
+          }
+          if (match.failed()) {
+            throw std::runtime_error(match.error_text());
+          }
         }
 
-        // receive a match result against a description the server has
-        FailureInfo info;
-        read(info);
+        // send the method index with trace ids, the request and the request attachment
+        {
+          MethodIndex index;
+          index.set_value(method->index());
+          setTraceIds(index, rpc_controller, trace);
+          ba::const_buffer attachment;
+          if (rpc_controller && rpc_controller->RequestAttachmentSize() > 0) {
+            attachment = ba::buffer(rpc_controller->RequestAttachment(),
+                                    rpc_controller->RequestAttachmentSize());
+            index.set_attachment_size(rpc_controller->RequestAttachmentSize());
+          }
+          if (one_way_methods_.count(method) > 0) {
+            index.set_one_way(true);
+          }
+          write(index, *request, attachment);
+          if (tracing_) {
+            trace.stamp(TraceRecord::CLIENT_REQUEST_WRITTEN);
+          }
+
+          // no result will come for a one-way method
+          if (index.one_way()) {
+            pushTrace(trace, false);
+            done->Run();
+            return;
+          }
+        }
 
-        // check the match result
-        if (!info.IsInitialized()) {
-          throw std::runtime_error("Uninitialized failure info");
+        read_buffer_.consume(read(read_buffer_, info));
+        if (!info.closing()) {
+          break;
         }
-        if (info.failed()) {
+        socket_.close();
+        if (attempt > 0) {
           throw std::runtime_error(info.error_text());
         }
       }
 
-      // send the method index and the request
-      {
-        MethodIndex index;
-        index.set_value(method->index());
-        write(index);
+      // the rest of the result is left unread if the attachment is too large
+      if (info.attachment_size() > max_attachment_size_) {
+        socket_.close();
+        throw std::runtime_error("Too large response attachment on client");
       }
-      write(*request);
 
-      // receive the failure info and the response
-      FailureInfo info;
-      read(info, *response);
+      // receive the response and the response attachment
+      {
+        read_buffer_.consume(read(read_buffer_, *response));
+        if (rpc_controller) {
+          rpc_controller->response_attachment_.clear();
+          if (info.attachment_size() > 0) {
+            read(read_buffer_,
+                 rpc_controller->allocateResponseAttachment(info.attachment_size()),
+                 info.attachment_size());
+          }
+        } else {
+          discard(read_buffer_, info.attachment_size());
+        }
+      }
+      if (tracing_) {
+        trace.stamp(TraceRecord::CLIENT_RESULT_READ);
+      }
 
       // check outputs
       if (!info.IsInitialized()) {
@@ -113,26 +223,66 @@ public:
       if (info.failed()) {
         throw std::runtime_error(info.error_text());
       }
-      if (!response->IsInitialized()) {
+      if (!isInitialized(*response)) {
         throw std::runtime_error("Uninitialized response");
       }
     } catch (const bs::system_error &error) {
       // a network error
       socket_.close();
       controller->SetFailed(error.what());
+      pushTrace(trace, true);
       done->Run();
       return;
     } catch (const std::runtime_error &error) {
       // a rpc failure not by network reasons
       controller->SetFailed(error.what());
+      pushTrace(trace, true);
       done->Run();
       return;
     }
 
+    pushTrace(trace, false);
     done->Run();
   }
 
-private:
+  static bool isInitialized(const gp::Message &message) { return message.IsInitialized(); }
+
+  // serialized messages are not checked
+  static bool isInitialized(const std::string &) { return true; }
+
+  void setTraceIds(MethodIndex &index, Controller *controller, TraceRecord &trace) {
+    // join the trace given by the controller, or start a new trace if tracing is enabled
+    gp::uint64 trace_id(controller ? controller->TraceId() : 0);
+    if (trace_id == 0 && tracing_) {
+      trace_id = TraceBuffer::local().newId();
+    }
+    if (trace_id == 0) {
+      return;
+    }
+
+    // a new span for this call. only the span id is given back to the controller. a trace id
+    // started here is not, so that a reused controller does not join later calls to this trace.
+    const gp::uint64 span_id(TraceBuffer::local().newId());
+    index.set_trace_id(trace_id);
+    index.set_span_id(span_id);
+    if (controller) {
+      controller->SetSpanId(span_id);
+    }
+
+    trace.trace_id = trace_id;
+    trace.span_id = span_id;
+    trace.method_index = index.value();
+  }
+
+  void pushTrace(TraceRecord &trace, const bool failed) {
+    if (!tracing_) {
+      return;
+    }
+    trace.stamp(TraceRecord::CLIENT_CALL_END);
+    trace.failed = failed;
+    TraceBuffer::local().push(trace);
+  }
+
   void connect() {
     // set timeout. on timeout, the expiration handler will cancel operations on the socket.
     timer_.expires_from_now(timeout_);
@@ -153,16 +303,12 @@ private:
     }
   }
 
-  void write(const gp::Message &message) {
-    // encode the given message
-    ba::streambuf buffer;
-    encode(message, buffer);
-
+  template < typename ConstBufferSequence > void writeBuffers(const ConstBufferSequence &buffers) {
     timer_.expires_from_now(timeout_);
     timer_.async_wait(boost::bind(&Channel::handleTimerEvent, this, _1));
 
     bs::error_code error;
-    ba::async_write(socket_, buffer,
+    ba::async_write(socket_, buffers,
                     boost::bind(&Channel::handleSocketEvent, this, _1, boost::ref(error)));
 
     queue_.reset();
@@ -173,13 +319,40 @@ private:
     }
   }
 
+  void write(const gp::Message &message) {
+    // encode the given message
+    ba::streambuf buffer;
+    encode(message, buffer);
+    writeBuffers(buffer.data());
+  }
+
+  template < typename Message2 >
+  void write(const gp::Message &message, const Message2 &message2,
+             const ba::const_buffer &attachment) {
+    // encode the given messages, and then gather them and the attachment without copying
+    ba::streambuf buffer;
+    encode(message, buffer);
+    encode(message2, buffer);
+    const boost::array< ba::const_buffer, 2 > buffers = {{buffer.data(), attachment}};
+    writeBuffers(buffers);
+  }
+
   std::size_t read(ba::streambuf &buffer, gp::Message &message) {
+    return readUntil(buffer, Decode(message));
+  }
+
+  std::size_t read(ba::streambuf &buffer, std::string &bytes) {
+    return readUntil(buffer, DecodeRaw(&bytes));
+  }
+
+  template < typename MatchCondition >
+  std::size_t readUntil(ba::streambuf &buffer, const MatchCondition &condition) {
     timer_.expires_from_now(timeout_);
     timer_.async_wait(boost::bind(&Channel::handleTimerEvent, this, _1));
 
     bs::error_code error;
     std::size_t bytes;
-    ba::async_read_until(socket_, buffer, Decode(message),
+    ba::async_read_until(socket_, buffer, condition,
                          boost::bind(&Channel::handleSocketEvent2, this, _1, _2, boost::ref(error),
                                      boost::ref(bytes)));
 
@@ -193,15 +366,64 @@ private:
     return bytes;
   }
 
-  void read(gp::Message &message) {
-    ba::streambuf buffer;
-    buffer.consume(read(buffer, message));
+  void read(ba::streambuf &buffer, char *data, const std::size_t size) {
+    // take bytes already in the buffer, and then read the rest directly into the destination
+    const std::size_t buffered(std::min(buffer.size(), size));
+    std::memcpy(data, ba::buffer_cast< const char * >(buffer.data()), buffered);
+    buffer.consume(buffered);
+    if (buffered == size) {
+      return;
+    }
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&Channel::handleTimerEvent, this, _1));
+
+    bs::error_code error;
+    std::size_t bytes;
+    ba::async_read(socket_, ba::buffer(data + buffered, size - buffered),
+                   boost::bind(&Channel::handleSocketEvent2, this, _1, _2, boost::ref(error),
+                               boost::ref(bytes)));
+
+    queue_.reset();
+    queue_.run();
+
+    if (error) {
+      throw bs::system_error(error);
+    }
   }
 
-  void read(gp::Message &message, gp::Message &message2) {
-    ba::streambuf buffer;
-    buffer.consume(read(buffer, message));
-    buffer.consume(read(buffer, message2));
+  // check if a closing info has been received without blocking. the bytes available on the
+  // socket are moved to the read buffer.
+  bool closingReceived() {
+    bs::error_code error;
+    const std::size_t available(socket_.available(error));
+    if (error) {
+      return true;
+    }
+    if (available > 0) {
+      const std::size_t bytes(socket_.read_some(read_buffer_.prepare(available), error));
+      if (error) {
+        return true;
+      }
+      read_buffer_.commit(bytes);
+    }
+
+    if (read_buffer_.size() == 0) {
+      return false;
+    }
+    const char *const begin(ba::buffer_cast< const char * >(read_buffer_.data()));
+    FailureInfo info;
+    return Decode(info)(begin, begin + read_buffer_.size()).second && info.closing();
+  }
+
+  void discard(ba::streambuf &buffer, std::size_t size) {
+    // read into a small chunk repeatedly instead of allocating the whole size
+    char chunk[DISCARD_SIZE];
+    while (size > 0) {
+      const std::size_t chunk_size(std::min< std::size_t >(size, DISCARD_SIZE));
+      read(buffer, chunk, chunk_size);
+      size -= chunk_size;
+    }
   }
 
   void handleSocketEvent(const bs::error_code &error, bs::error_code &error_out) {
@@ -227,11 +449,18 @@ private:
   }
 
 private:
+  enum { DISCARD_SIZE = 4096 };
+
   const ba::ip::tcp::endpoint endpoint_;
   const bp::time_duration timeout_;
   ba::io_service queue_;
   ba::ip::tcp::socket socket_;
   ba::deadline_timer timer_;
+  // kept over calls because it may contain a closing info following a result
+  ba::streambuf read_buffer_;
+  bool tracing_;
+  std::size_t max_attachment_size_;
+  std::set< const gp::MethodDescriptor * > one_way_methods_;
 };
 }
 
@@ -1,13 +1,22 @@
 #ifndef PROTO_RPC_CONTROLLER
 #define PROTO_RPC_CONTROLLER
 
-#include <google/protobuf/service.h> // for RpcConteoller
+#include <cstddef>
+#include <vector>
+
+#include <boost/scoped_array.hpp>
+
+#include <google/protobuf/service.h>      // for RpcConteoller
+#include <google/protobuf/stubs/common.h> // for uint64
 
 #include <proto_rpc/namespace.hpp>
 
 namespace proto_rpc {
 
 class Controller : public gp::RpcController {
+  friend class Channel;
+  friend class Session;
+
 public:
   Controller() { Reset(); }
 
@@ -18,6 +27,12 @@ public:
   void Reset() {
     failed_ = false;
     error_text_.clear();
+    trace_id_ = 0;
+    span_id_ = 0;
+    request_attachment_.clear();
+    response_attachment_.clear();
+    response_attachment_buffer_ = NULL;
+    response_attachment_capacity_ = 0;
   }
 
   bool Failed() const { return failed_; }
@@ -37,9 +52,114 @@ public:
 
   void NotifyOnCancel(gp::Closure *) {}
 
+  // trace ids (0 if not traced). on a client, set a trace id before a call to join the call to
+  // an existing trace, and the span id of the call is set after the call. a trace started by
+  // the channel is not set to the controller. on a server, they are the ids received from the
+  // client.
+
+  gp::uint64 TraceId() const { return trace_id_; }
+
+  void SetTraceId(const gp::uint64 trace_id) { trace_id_ = trace_id; }
+
+  gp::uint64 SpanId() const { return span_id_; }
+
+  void SetSpanId(const gp::uint64 span_id) { span_id_ = span_id; }
+
+  // attachments. raw bytes sent after the request or the response without serialization.
+  // on a client, set the request attachment before a call and get the response attachment after.
+  // on a server, get the request attachment and set the response attachment in a method.
+  // the pointer versions of setters do not copy the data, so the data must be valid until
+  // written. the vector versions take the data by swapping. on a server, the request attachment
+  // is valid until the method returns.
+
+  const char *RequestAttachment() const { return request_attachment_.data; }
+
+  std::size_t RequestAttachmentSize() const { return request_attachment_.size; }
+
+  void SetRequestAttachment(const void *data, const std::size_t size) {
+    request_attachment_.refer(data, size);
+  }
+
+  void SetRequestAttachment(std::vector< char > &data) { request_attachment_.swap(data); }
+
+  const char *ResponseAttachment() const { return response_attachment_.data; }
+
+  std::size_t ResponseAttachmentSize() const { return response_attachment_.size; }
+
+  void SetResponseAttachment(const void *data, const std::size_t size) {
+    response_attachment_.refer(data, size);
+  }
+
+  void SetResponseAttachment(std::vector< char > &data) { response_attachment_.swap(data); }
+
+  // on a client, receive the response attachment into the given buffer if it is large enough.
+  // otherwise, the attachment is received into a buffer owned and reused by this controller.
+  void SetResponseAttachmentBuffer(void *data, const std::size_t capacity) {
+    response_attachment_buffer_ = static_cast< char * >(data);
+    response_attachment_capacity_ = capacity;
+  }
+
+private:
+  // raw bytes either referred or owned
+  struct Attachment {
+    Attachment() : data(NULL), size(0), allocated_capacity(0) {}
+
+    void clear() {
+      // the storage is kept to be reused
+      data = NULL;
+      size = 0;
+    }
+
+    void refer(const void *_data, const std::size_t _size) {
+      data = static_cast< const char * >(_data);
+      size = _size;
+    }
+
+    void swap(std::vector< char > &_data) {
+      storage.swap(_data);
+      refer(storage.empty() ? NULL : &storage[0], storage.size());
+    }
+
+    // a writable range of the given size in the given buffer if enough, or in the allocated
+    // buffer. the allocated buffer is reused while large enough, and is not initialized.
+    char *allocate(const std::size_t _size, char *buffer = NULL, const std::size_t capacity = 0) {
+      if (!buffer || capacity < _size) {
+        if (allocated_capacity < _size) {
+          allocated.reset(new char[_size]);
+          allocated_capacity = _size;
+        }
+        buffer = allocated.get();
+      }
+      refer(buffer, _size);
+      return buffer;
+    }
+
+    const char *data;
+    std::size_t size;
+    std::vector< char > storage; // taken by swapping
+    boost::scoped_array< char > allocated;
+    std::size_t allocated_capacity;
+  };
+
+  char *allocateRequestAttachment(const std::size_t size, char *buffer = NULL,
+                                  const std::size_t capacity = 0) {
+    return request_attachment_.allocate(size, buffer, capacity);
+  }
+
+  char *allocateResponseAttachment(const std::size_t size) {
+    return response_attachment_.allocate(size, response_attachment_buffer_,
+                                         response_attachment_capacity_);
+  }
+
 private:
   bool failed_;
   gp::string error_text_;
+  gp::uint64 trace_id_;
+  gp::uint64 span_id_;
+  Attachment request_attachment_;
+  Attachment response_attachment_;
+  char *response_attachment_buffer_;
+  std::size_t response_attachment_capacity_;
 };
 }
 
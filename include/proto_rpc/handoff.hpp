@@ -0,0 +1,166 @@
+#ifndef PROTO_RPC_HANDOFF
+#define PROTO_RPC_HANDOFF
+
+#include <errno.h>
+#include <sys/socket.h> // for socket, sendmsg, recvmsg
+#include <sys/un.h>     // for sockaddr_un
+#include <unistd.h>     // for close, unlink
+
+#include <cstring> // for memcpy, memset
+#include <string>
+
+#include <boost/system/error_code.hpp>
+#include <boost/system/system_error.hpp>
+
+#include <proto_rpc/namespace.hpp>
+
+namespace proto_rpc {
+
+/*
+* handoff of a listening socket to a successor process, so that the port keeps accepting over a
+* restart
+*   1. the successor waits on a unix domain socket at a path by receiveListener()
+*   2. the predecessor passes its listening socket to the path by Server::handOff(), which then
+*      drains sessions of the predecessor
+*   3. the successor constructs a Server with the received listener
+*/
+
+// a listening socket received from a predecessor process
+struct Listener {
+  explicit Listener(const int _fd) : fd(_fd) {}
+
+  int fd;
+};
+
+namespace handoff_detail {
+
+static inline void throwSystemError(const int error, const std::string &what) {
+  throw bs::system_error(bs::error_code(error, bs::system_category()), what);
+}
+
+static inline sockaddr_un unixAddress(const std::string &path) {
+  sockaddr_un address;
+  std::memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throwSystemError(ENAMETOOLONG, path);
+  }
+  std::memcpy(address.sun_path, path.c_str(), path.size());
+  return address;
+}
+
+// closes the descriptor on scope exit
+struct ScopedFd {
+  explicit ScopedFd(const int _fd) : fd(_fd) {}
+
+  ~ScopedFd() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+
+  int fd;
+};
+}
+
+// pass the listening socket to a successor waiting at the path, and wait until the successor
+// acknowledges it. the socket is kept open in this process.
+static inline void sendListener(const std::string &path, const int fd) {
+  const sockaddr_un address(handoff_detail::unixAddress(path));
+  const handoff_detail::ScopedFd sock(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (sock.fd < 0) {
+    handoff_detail::throwSystemError(errno, path);
+  }
+  if (connect(sock.fd, reinterpret_cast< const sockaddr * >(&address), sizeof(address)) != 0) {
+    handoff_detail::throwSystemError(errno, path);
+  }
+
+  // a single byte carrying the descriptor. a peer gone away fails the call with EPIPE instead of
+  // raising SIGPIPE.
+  char byte('L');
+  iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  std::memset(control, 0, sizeof(control));
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  cmsghdr *const cmsg(CMSG_FIRSTHDR(&message));
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  if (sendmsg(sock.fd, &message, MSG_NOSIGNAL) != 1) {
+    handoff_detail::throwSystemError(errno, path);
+  }
+
+  // the acknowledgement
+  const ssize_t received(recv(sock.fd, &byte, 1, MSG_NOSIGNAL));
+  if (received != 1) {
+    handoff_detail::throwSystemError(received < 0 ? errno : ECONNRESET, path);
+  }
+}
+
+// wait a predecessor to pass its listening socket to the path. this blocks until the socket is
+// received. the path is created and removed by this function.
+static inline Listener receiveListener(const std::string &path) {
+  const sockaddr_un address(handoff_detail::unixAddress(path));
+  const handoff_detail::ScopedFd listener(socket(AF_UNIX, SOCK_STREAM, 0));
+  if (listener.fd < 0) {
+    handoff_detail::throwSystemError(errno, path);
+  }
+  unlink(path.c_str());
+  if (bind(listener.fd, reinterpret_cast< const sockaddr * >(&address), sizeof(address)) != 0 ||
+      listen(listener.fd, 1) != 0) {
+    const int error(errno);
+    unlink(path.c_str());
+    handoff_detail::throwSystemError(error, path);
+  }
+  const handoff_detail::ScopedFd sock(accept(listener.fd, NULL, NULL));
+  const int accept_error(errno);
+  unlink(path.c_str());
+  if (sock.fd < 0) {
+    handoff_detail::throwSystemError(accept_error, path);
+  }
+
+  // the single byte carrying the descriptor
+  char byte;
+  iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  char control[CMSG_SPACE(sizeof(int))];
+  msghdr message;
+  std::memset(&message, 0, sizeof(message));
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  // the received descriptor is not inherited by child processes, like sockets opened by asio
+  const ssize_t received(recvmsg(sock.fd, &message, MSG_CMSG_CLOEXEC));
+  if (received != 1) {
+    handoff_detail::throwSystemError(received < 0 ? errno : ECONNRESET, path);
+  }
+  const cmsghdr *const cmsg(CMSG_FIRSTHDR(&message));
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    handoff_detail::throwSystemError(EBADMSG, path);
+  }
+  int fd;
+  std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+  // acknowledge so that the predecessor starts draining
+  if (send(sock.fd, &byte, 1, MSG_NOSIGNAL) != 1) {
+    const int error(errno);
+    close(fd);
+    handoff_detail::throwSystemError(error, path);
+  }
+
+  return Listener(fd);
+}
+}
+
+#endif // PROTO_RPC_HANDOFF
@@ -1,7 +1,9 @@
 #ifndef PROTO_RPC_MESSAGE_CODING
 #define PROTO_RPC_MESSAGE_CODING
 
+#include <cstddef>
 #include <iostream>
+#include <string>
 #include <utility> // for pair
 
 #include <boost/asio/read_until.hpp> // for is_match_condition
@@ -26,6 +28,16 @@ static inline void encode(const gp::Message &message, ba::streambuf &buffer) {
   message.SerializeWithCachedSizes(&output);
 }
 
+static inline void encode(const std::string &bytes, ba::streambuf &buffer) {
+  std::ostream os(&buffer);
+  gp::io::OstreamOutputStream oos(&os);
+  gp::io::CodedOutputStream output(&oos);
+
+  // write the length and then the serialized message as is
+  output.WriteVarint32(bytes.size());
+  output.WriteString(bytes);
+}
+
 class Decode {
 public:
   Decode(gp::Message &message) : message_(message) {}
@@ -65,12 +77,54 @@ public:
 private:
   gp::Message &message_;
 };
+
+// matches an encoded message which starts at the given offset without parsing the message.
+// the serialized message is copied to the given string if any.
+class DecodeRaw {
+public:
+  DecodeRaw(std::string *bytes = NULL, const std::size_t offset = 0)
+      : bytes_(bytes), offset_(offset) {}
+
+  virtual ~DecodeRaw() {}
+
+  template < typename Iterator >
+  std::pair< Iterator, bool > operator()(Iterator begin, Iterator end) const {
+    if (end - begin <= static_cast< std::ptrdiff_t >(offset_)) {
+      return std::pair< Iterator, bool >(begin, false);
+    }
+
+    // convert the range after the offset to an input stream
+    const gp::uint8 *const data(reinterpret_cast< const gp::uint8 * >(&(*(begin + offset_))));
+    const int size(static_cast< int >(end - begin - offset_));
+    gp::io::CodedInputStream input(data, size);
+
+    // read the message length and check if the message data is in the range
+    gp::uint32 message_size;
+    if (!input.ReadVarint32(&message_size) ||
+        static_cast< gp::uint64 >(input.CurrentPosition()) + message_size >
+            static_cast< gp::uint64 >(size)) {
+      return std::pair< Iterator, bool >(begin, false);
+    }
+
+    if (bytes_) {
+      bytes_->assign(reinterpret_cast< const char * >(data) + input.CurrentPosition(),
+                     message_size);
+    }
+    return std::pair< Iterator, bool >(begin + offset_ + input.CurrentPosition() + message_size,
+                                       true);
+  }
+
+private:
+  std::string *const bytes_;
+  const std::size_t offset_;
+};
 }
 
 // export Decode to boost.asio
 namespace boost {
 namespace asio {
 template <> struct is_match_condition< proto_rpc::Decode > : public boost::true_type {};
+template <> struct is_match_condition< proto_rpc::DecodeRaw > : public boost::true_type {};
 }
 }
 
@@ -0,0 +1,874 @@
+#ifndef PROTO_RPC_PROXY
+#define PROTO_RPC_PROXY
+
+#include <algorithm> // for min
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/completion_condition.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/error.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time_duration.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <proto_rpc/message_coding.hpp>
+#include <proto_rpc/messages.hpp>
+#include <proto_rpc/namespace.hpp>
+
+namespace proto_rpc {
+
+// method indices to backend endpoints
+struct ProxyRoutes {
+  ProxyRoutes(const ba::ip::tcp::endpoint &_fallback) : fallback(_fallback) {}
+
+  const ba::ip::tcp::endpoint &find(const int method_index) const {
+    const std::map< int, ba::ip::tcp::endpoint >::const_iterator route(routes.find(method_index));
+    return route != routes.end() ? route->second : fallback;
+  }
+
+  ba::ip::tcp::endpoint fallback;
+  std::map< int, ba::ip::tcp::endpoint > routes;
+};
+
+// relays RPCs of a client to backend servers. only the method index and the failure info are
+// parsed. requests, responses and attachments are relayed as bytes.
+class ProxySession : public boost::enable_shared_from_this< ProxySession > {
+  friend class Proxy;
+
+public:
+  ProxySession(ba::io_service &queue, const ProxyRoutes &routes, const bp::time_duration &timeout)
+      : socket_(queue), timer_(queue), routes_(routes), timeout_(timeout),
+        max_attachment_size_(0), relay_buffer_(RELAY_CHUNK_SIZE) {}
+
+  virtual ~ProxySession() { std::cout << "ProxySession " << this << ": Closed" << std::endl; }
+
+  void start() {
+    std::cout << "ProxySession " << this << ": Started with " << socket_.remote_endpoint()
+              << std::endl;
+    startReadServiceDescriptor();
+  }
+
+private:
+  enum { RELAY_CHUNK_SIZE = 64 * 1024 };
+
+  // a connection to a backend server, which is authorized with the client's service descriptor
+  struct Backend {
+    Backend(ba::io_service &queue, const ba::ip::tcp::endpoint &_endpoint)
+        : endpoint(_endpoint), socket(queue), authorized(false) {}
+
+    const ba::ip::tcp::endpoint endpoint;
+    ba::ip::tcp::socket socket;
+    ba::streambuf read_buffer;
+    ba::streambuf write_buffer;
+    bool authorized;
+  };
+
+  // data used in the initial authorization or a single RPC
+  struct RpcData {
+    RpcData()
+        : initial(false), request_bytes(0), request_remaining(0), result_bytes(0),
+          response_remaining(0), request_buffered(false), resent(false), close_session(false) {}
+
+    virtual ~RpcData() {}
+
+    void setFailed(const gp::string &error_text) {
+      info.Clear();
+      info.set_failed(true);
+      info.set_error_text(error_text);
+    }
+
+    bool initial;
+    boost::shared_ptr< Backend > backend;
+
+    MethodIndex index;
+    std::size_t request_bytes;    // the request part at the front of the client buffer
+    gp::uint64 request_remaining; // the request attachment not yet read from the client
+
+    FailureInfo info;
+    std::size_t result_bytes;      // the result part at the front of the backend buffer
+    gp::uint64 response_remaining; // the response attachment not yet read from the backend
+
+    bool request_buffered; // the whole request is kept in the client buffer
+    bool resent;           // the request has been sent again to a new backend connection
+    bool close_session;    // close this session after the result
+    ba::streambuf write_buffer; // a result made by this proxy
+  };
+
+private:
+  /*
+  * initial authorization steps
+  *   1. read the descriptor of the client-side service
+  *   2. authorize the fallback backend with the descriptor
+  *   3. write the authorization result of the backend
+  *   4. start the first RPC if the authorization is ok
+  */
+
+  void startReadServiceDescriptor() {
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_read_until(socket_, read_buffer_, DecodeRaw(&descriptor_),
+                         boost::bind(&ProxySession::handleReadServiceDescriptor, this, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadServiceDescriptor(const bs::error_code &error, const std::size_t bytes,
+                                   const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on reading service descriptor: " << error.message() << std::endl;
+      return;
+    }
+
+    read_buffer_.consume(bytes);
+
+    const boost::shared_ptr< RpcData > data(boost::make_shared< RpcData >());
+    data->initial = true;
+    data->backend = findBackend(routes_.fallback);
+    startConnectBackend(data);
+  }
+
+  void startWriteAuthorizationResult(const boost::shared_ptr< RpcData > &data) {
+    encode(data->info, data->write_buffer);
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_write(socket_, data->write_buffer,
+                    boost::bind(&ProxySession::handleWriteAuthorizationResult, this, data, _1,
+                                shared_from_this()));
+  }
+
+  void
+  handleWriteAuthorizationResult(const boost::shared_ptr< RpcData > &data,
+                                 const bs::error_code &error,
+                                 const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on writing authorization result: " << error.message() << std::endl;
+      return;
+    }
+
+    if (!data->info.failed()) {
+      startReadMethodIndex();
+    }
+  }
+
+  /*
+  * backend authorization steps
+  *   1. connect to the backend
+  *   2. write the descriptor of the client-side service
+  *   3. read the authorization result
+  *   4. go back to the initial authorization or the RPC
+  */
+
+  boost::shared_ptr< Backend > findBackend(const ba::ip::tcp::endpoint &endpoint) {
+    boost::shared_ptr< Backend > &backend(backends_[endpoint]);
+    if (!backend) {
+      backend = boost::make_shared< Backend >(boost::ref(socket_.get_io_service()), endpoint);
+    }
+    return backend;
+  }
+
+  void startConnectBackend(const boost::shared_ptr< RpcData > &data) {
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    data->backend->socket.async_connect(data->backend->endpoint,
+                                        boost::bind(&ProxySession::handleConnectBackend, this,
+                                                    data, _1, shared_from_this()));
+  }
+
+  void handleConnectBackend(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                            const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      finishBackendAuthorization(data, "Error on connecting backend on proxy: " +
+                                           error.message());
+      return;
+    }
+
+    encode(descriptor_, data->backend->write_buffer);
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_write(data->backend->socket, data->backend->write_buffer,
+                    boost::bind(&ProxySession::handleWriteBackendDescriptor, this, data, _1,
+                                shared_from_this()));
+  }
+
+  void
+  handleWriteBackendDescriptor(const boost::shared_ptr< RpcData > &data,
+                               const bs::error_code &error,
+                               const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      finishBackendAuthorization(data, "Error on writing backend descriptor on proxy: " +
+                                           error.message());
+      return;
+    }
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_read_until(data->backend->socket, data->backend->read_buffer, Decode(data->info),
+                         boost::bind(&ProxySession::handleReadBackendAuthorization, this, data, _1,
+                                     _2, shared_from_this()));
+  }
+
+  void
+  handleReadBackendAuthorization(const boost::shared_ptr< RpcData > &data,
+                                 const bs::error_code &error, const std::size_t bytes,
+                                 const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      finishBackendAuthorization(data, "Error on reading backend authorization on proxy: " +
+                                           error.message());
+      return;
+    }
+
+    data->backend->read_buffer.consume(bytes);
+
+    if (!data->info.IsInitialized()) {
+      finishBackendAuthorization(data, "Uninitialized backend authorization on proxy");
+      return;
+    }
+    if (data->info.failed()) {
+      finishBackendAuthorization(data, data->info.error_text());
+      return;
+    }
+
+    data->backend->authorized = true;
+    finishBackendAuthorization(data, gp::string());
+  }
+
+  void finishBackendAuthorization(const boost::shared_ptr< RpcData > &data,
+                                  const gp::string &error_text) {
+    // forget the backend on failure so that the next RPC retries
+    if (!error_text.empty()) {
+      backends_.erase(data->backend->endpoint);
+      data->setFailed(error_text);
+    }
+
+    if (data->initial) {
+      startWriteAuthorizationResult(data);
+    } else if (data->info.failed()) {
+      startWriteFailure(data);
+    } else {
+      startWriteRequest(data);
+    }
+  }
+
+  /*
+  * RPC steps
+  *   1. read the index of a method to be called
+  *   2. read a request of the method without parsing, and a small attachment of the request
+  *      if any (go 8 if the attachment is too large)
+  *   3. authorize the backend routed by the index if not yet, or if the backend is closing
+  *   4. write the index, the request and the buffered part of the attachment to the backend
+  *   5. relay the rest of the attachment in chunks (go 1 if one-way)
+  *   6. read the failure info from the backend (go 3 on a new backend connection if the backend
+  *      is closing the session and the whole request is buffered)
+  *   7. read the response from the backend
+  *   8. write them and the buffered part of the attachment to the client (close this session
+  *      if the backend is closing the session, so that the client sends the request again)
+  *   9. relay the rest of the attachment in chunks (go 1)
+  *   on a failure of the backend or its authorization, discard the rest of the request and write
+  *   the failure to the client (go 1, or close this session if the attachment is too large)
+  */
+
+  void startReadMethodIndex() {
+    const boost::shared_ptr< RpcData > data(boost::make_shared< RpcData >());
+
+    // wait the first data or disconnection from the client without timeout
+    ba::async_read_until(socket_, read_buffer_, Decode(data->index),
+                         boost::bind(&ProxySession::handleReadMethodIndex, this, data, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadMethodIndex(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                             const std::size_t bytes,
+                             const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    if (error == ba::error::eof) { // disconnected by the client
+      return;
+    } else if (error) {
+      std::cerr << "ProxySession " << this << ": Error on reading method index: "
+                << error.message() << std::endl;
+      return;
+    }
+
+    // keep the index in the buffer to relay it as is. read the request following the index.
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_read_until(socket_, read_buffer_, DecodeRaw(NULL, bytes),
+                         boost::bind(&ProxySession::handleReadRequest, this, data, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadRequest(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                         const std::size_t bytes,
+                         const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this << ": Error on reading request: " << error.message()
+                << std::endl;
+      return;
+    }
+
+    // the rest of the request is left unread if the attachment is too large
+    if (data->index.attachment_size() > max_attachment_size_) {
+      data->setFailed("Too large request attachment on proxy");
+      data->close_session = true;
+      startWriteFailure(data);
+      return;
+    }
+
+    // the index, the request and the buffered part of the attachment are at the front of the
+    // buffer. the rest of the attachment is relayed in chunks later.
+    const std::size_t size(data->index.attachment_size());
+    const std::size_t buffered(std::min(read_buffer_.size() - bytes, size));
+    data->request_bytes = bytes + buffered;
+    data->request_remaining = size - buffered;
+
+    // read a small attachment into the buffer to keep the whole request, which can be sent again
+    // if the backend is closing the session
+    if (data->request_remaining > 0 && data->request_remaining <= RELAY_CHUNK_SIZE) {
+      timer_.expires_from_now(timeout_);
+      timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+      ba::async_read(socket_, read_buffer_, ba::transfer_exactly(data->request_remaining),
+                     boost::bind(&ProxySession::handleReadRequestAttachment, this, data, _1, _2,
+                                 shared_from_this()));
+      return;
+    }
+
+    startRouteRequest(data);
+  }
+
+  void handleReadRequestAttachment(const boost::shared_ptr< RpcData > &data,
+                                   const bs::error_code &error, const std::size_t bytes,
+                                   const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on reading request attachment: " << error.message() << std::endl;
+      return;
+    }
+
+    data->request_bytes += bytes;
+    data->request_remaining = 0;
+
+    startRouteRequest(data);
+  }
+
+  void startRouteRequest(const boost::shared_ptr< RpcData > &data) {
+    data->request_buffered = (data->request_remaining == 0);
+
+    // route the RPC by the method index. bytes from the backend before the request tell that the
+    // backend is closing the session (e.g. on drain), so connect again instead of using it.
+    data->backend = findBackend(routes_.find(data->index.value()));
+    if (data->backend->authorized && isClosing(*data->backend)) {
+      backends_.erase(data->backend->endpoint);
+      data->backend = findBackend(routes_.find(data->index.value()));
+    }
+    if (!data->backend->authorized) {
+      startConnectBackend(data);
+      return;
+    }
+
+    startWriteRequest(data);
+  }
+
+  void startWriteRequest(const boost::shared_ptr< RpcData > &data) {
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    // relay the front of the buffer as is
+    ba::async_write(data->backend->socket, ba::buffer(read_buffer_.data(), data->request_bytes),
+                    boost::bind(&ProxySession::handleWriteRequest, this, data, _1,
+                                shared_from_this()));
+  }
+
+  void handleWriteRequest(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                          const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      backends_.erase(data->backend->endpoint);
+      data->setFailed("Error on writing request to backend on proxy: " + error.message());
+      startWriteFailure(data);
+      return;
+    }
+
+    startRelayRequestAttachment(data);
+  }
+
+  void startRelayRequestAttachment(const boost::shared_ptr< RpcData > &data) {
+    // the whole request has been relayed. no result will come for a one-way RPC.
+    if (data->request_remaining == 0) {
+      if (data->index.one_way()) {
+        consumeRequest(data);
+        startReadMethodIndex();
+      } else {
+        startReadFailureInfo(data);
+      }
+      return;
+    }
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    socket_.async_read_some(relayChunk(data->request_remaining),
+                            boost::bind(&ProxySession::handleReadRequestChunk, this, data, _1, _2,
+                                        shared_from_this()));
+  }
+
+  void handleReadRequestChunk(const boost::shared_ptr< RpcData > &data,
+                              const bs::error_code &error, const std::size_t bytes,
+                              const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on reading request attachment: " << error.message() << std::endl;
+      return;
+    }
+
+    data->request_remaining -= bytes;
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_write(data->backend->socket, ba::buffer(relay_buffer_, bytes),
+                    boost::bind(&ProxySession::handleWriteRequestChunk, this, data, _1,
+                                shared_from_this()));
+  }
+
+  void handleWriteRequestChunk(const boost::shared_ptr< RpcData > &data,
+                               const bs::error_code &error,
+                               const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      backends_.erase(data->backend->endpoint);
+      data->setFailed("Error on writing request attachment to backend on proxy: " +
+                      error.message());
+      startWriteFailure(data);
+      return;
+    }
+
+    startRelayRequestAttachment(data);
+  }
+
+  void startReadFailureInfo(const boost::shared_ptr< RpcData > &data) {
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_read_until(data->backend->socket, data->backend->read_buffer, Decode(data->info),
+                         boost::bind(&ProxySession::handleReadFailureInfo, this, data, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadFailureInfo(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                             const std::size_t bytes,
+                             const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      backends_.erase(data->backend->endpoint);
+      data->setFailed("Error on reading failure info from backend on proxy: " + error.message());
+      startWriteFailure(data);
+      return;
+    }
+
+    // the backend is closing the session without processing the request (e.g. on drain).
+    // send the request once again on a new backend connection if the whole request is buffered.
+    // otherwise relay the info alone and then close this session too, so that the client sends
+    // the request again on a new connection.
+    if (data->info.closing()) {
+      backends_.erase(data->backend->endpoint);
+      if (data->request_buffered && !data->resent) {
+        data->resent = true;
+        data->info.Clear();
+        startRouteRequest(data);
+        return;
+      }
+      consumeRequest(data);
+      data->result_bytes = bytes;
+      startWriteResult(data);
+      return;
+    }
+
+    consumeRequest(data);
+
+    // keep the info in the buffer to relay it as is. read the response following the info.
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_read_until(data->backend->socket, data->backend->read_buffer,
+                         DecodeRaw(NULL, bytes),
+                         boost::bind(&ProxySession::handleReadResponse, this, data, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadResponse(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                          const std::size_t bytes,
+                          const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      backends_.erase(data->backend->endpoint);
+      data->setFailed("Error on reading response from backend on proxy: " + error.message());
+      startWriteFailure(data);
+      return;
+    }
+
+    // the backend connection cannot be reused as the rest of the result is left unread
+    const std::size_t size(data->info.attachment_size());
+    if (size > max_attachment_size_) {
+      backends_.erase(data->backend->endpoint);
+      data->setFailed("Too large response attachment from backend on proxy");
+      startWriteFailure(data);
+      return;
+    }
+
+    // the info, the response and the buffered part of the attachment are at the front of the
+    // backend buffer. the rest of the attachment is relayed in chunks later.
+    const std::size_t buffered(std::min(data->backend->read_buffer.size() - bytes, size));
+    data->result_bytes = bytes + buffered;
+    data->response_remaining = size - buffered;
+
+    startWriteResult(data);
+  }
+
+  void startWriteResult(const boost::shared_ptr< RpcData > &data) {
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    // relay the front of the backend buffer as is
+    ba::async_write(socket_, ba::buffer(data->backend->read_buffer.data(), data->result_bytes),
+                    boost::bind(&ProxySession::handleWriteResult, this, data, _1,
+                                shared_from_this()));
+  }
+
+  void handleWriteResult(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                         const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this << ": Error on writing RPC result: " << error.message()
+                << std::endl;
+      return;
+    }
+
+    data->backend->read_buffer.consume(data->result_bytes);
+
+    // close this session after relaying a closing info
+    if (data->info.closing()) {
+      startLinger();
+      return;
+    }
+
+    startRelayResponseAttachment(data);
+  }
+
+  void startRelayResponseAttachment(const boost::shared_ptr< RpcData > &data) {
+    // the whole result has been relayed
+    if (data->response_remaining == 0) {
+      startReadMethodIndex();
+      return;
+    }
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    data->backend->socket.async_read_some(relayChunk(data->response_remaining),
+                                          boost::bind(&ProxySession::handleReadResponseChunk,
+                                                      this, data, _1, _2, shared_from_this()));
+  }
+
+  void handleReadResponseChunk(const boost::shared_ptr< RpcData > &data,
+                               const bs::error_code &error, const std::size_t bytes,
+                               const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    // the result cannot be completed as a part of it has been written to the client
+    if (error) {
+      backends_.erase(data->backend->endpoint);
+      std::cerr << "ProxySession " << this << ": Error on reading response attachment: "
+                << error.message() << std::endl;
+      return;
+    }
+
+    data->response_remaining -= bytes;
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_write(socket_, ba::buffer(relay_buffer_, bytes),
+                    boost::bind(&ProxySession::handleWriteResponseChunk, this, data, _1,
+                                shared_from_this()));
+  }
+
+  void handleWriteResponseChunk(const boost::shared_ptr< RpcData > &data,
+                                const bs::error_code &error,
+                                const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on writing response attachment: " << error.message() << std::endl;
+      return;
+    }
+
+    startRelayResponseAttachment(data);
+  }
+
+  /*
+  * failure steps
+  *   1. discard the rest of the request from the client
+  *   2. write the failure made by this proxy (go 1 of the RPC steps if not one-way)
+  *   3. close this session if the attachment is too large, after a closing info so that
+  *      the client sends the next request on a new connection
+  */
+
+  void startWriteFailure(const boost::shared_ptr< RpcData > &data) {
+    // discard the buffered part of the request
+    consumeRequest(data);
+    startDiscardRequestAttachment(data);
+  }
+
+  void startDiscardRequestAttachment(const boost::shared_ptr< RpcData > &data) {
+    if (data->request_remaining == 0 || data->close_session) {
+      finishDiscardRequest(data);
+      return;
+    }
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    socket_.async_read_some(relayChunk(data->request_remaining),
+                            boost::bind(&ProxySession::handleDiscardRequestAttachment, this, data,
+                                        _1, _2, shared_from_this()));
+  }
+
+  void
+  handleDiscardRequestAttachment(const boost::shared_ptr< RpcData > &data,
+                                 const bs::error_code &error, const std::size_t bytes,
+                                 const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on reading request attachment: " << error.message() << std::endl;
+      return;
+    }
+
+    data->request_remaining -= bytes;
+    startDiscardRequestAttachment(data);
+  }
+
+  void finishDiscardRequest(const boost::shared_ptr< RpcData > &data) {
+    // no result for a one-way RPC
+    if (data->index.one_way() && !data->close_session) {
+      startReadMethodIndex();
+      return;
+    }
+
+    // a failure made by this proxy and an empty response
+    if (!data->index.one_way()) {
+      encode(data->info, data->write_buffer);
+      encode(Placeholder(), data->write_buffer);
+    }
+    if (data->close_session) {
+      FailureInfo closing;
+      closing.set_failed(true);
+      closing.set_error_text("Session closed by proxy");
+      closing.set_closing(true);
+      encode(closing, data->write_buffer);
+    }
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_write(socket_, data->write_buffer, boost::bind(&ProxySession::handleWriteFailure,
+                                                             this, data, _1, shared_from_this()));
+  }
+
+  void handleWriteFailure(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
+                          const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "ProxySession " << this << ": Error on writing RPC failure: "
+                << error.message() << std::endl;
+      return;
+    }
+
+    if (data->close_session) {
+      startLinger();
+      return;
+    }
+
+    startReadMethodIndex();
+  }
+
+  void startLinger() {
+    // shut down sending and discard data from the client until it disconnects or the timeout,
+    // so that the written result is not lost by a reset on closing with unread data
+    bs::error_code ignored;
+    socket_.shutdown(ba::ip::tcp::socket::shutdown_send, ignored);
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&ProxySession::handleExpire, this, _1, shared_from_this()));
+    startDiscard();
+  }
+
+  void startDiscard() {
+    socket_.async_read_some(relayChunk(RELAY_CHUNK_SIZE),
+                            boost::bind(&ProxySession::handleDiscard, this, _1,
+                                        shared_from_this()));
+  }
+
+  void handleDiscard(const bs::error_code &error,
+                     const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    // end of this session on the disconnection, the timeout or any error
+    if (error) {
+      timer_.cancel();
+      return;
+    }
+    startDiscard();
+  }
+
+  void handleExpire(const bs::error_code &error,
+                    const boost::shared_ptr< ProxySession > & /*tracked_this_ptr*/) {
+    if (error == ba::error::operation_aborted) { // timeout is canceled
+      return;
+    } else if (error) {
+      std::cerr << "ProxySession " << this
+                << ": Error on waiting expiration: " << error.message() << std::endl;
+      return;
+    }
+
+    socket_.cancel();
+    for (std::map< ba::ip::tcp::endpoint, boost::shared_ptr< Backend > >::iterator backend =
+             backends_.begin();
+         backend != backends_.end(); ++backend) {
+      backend->second->socket.cancel();
+    }
+  }
+
+  // the request relayed to the backend is kept at the front of the buffer until the backend
+  // accepts it, and then consumed by this
+  void consumeRequest(const boost::shared_ptr< RpcData > &data) {
+    read_buffer_.consume(data->request_bytes);
+    data->request_bytes = 0;
+  }
+
+  // check if the backend has sent bytes without a request, which must be a closing info,
+  // or has been disconnected
+  static bool isClosing(Backend &backend) {
+    bs::error_code error;
+    return backend.read_buffer.size() > 0 || backend.socket.available(error) > 0 || error;
+  }
+
+  // a part of the relay buffer to read the next chunk of an attachment into
+  ba::mutable_buffers_1 relayChunk(const gp::uint64 remaining) {
+    return ba::buffer(relay_buffer_, std::min< gp::uint64 >(remaining, relay_buffer_.size()));
+  }
+
+private:
+  ba::ip::tcp::socket socket_;
+  ba::deadline_timer timer_;
+  ba::streambuf read_buffer_;
+  ProxyRoutes routes_;
+  const bp::time_duration timeout_;
+  std::string descriptor_; // the serialized descriptor of the client-side service
+  std::map< ba::ip::tcp::endpoint, boost::shared_ptr< Backend > > backends_;
+  std::size_t max_attachment_size_;
+  std::vector< char > relay_buffer_; // a chunk of an attachment being relayed
+};
+
+// forwards RPCs from clients to backend servers by method index
+class Proxy {
+public:
+  enum { DEFAULT_SESSION_TIMEOUT = 5000, DEFAULT_MAX_ATTACHMENT_SIZE = 256 * 1024 * 1024 };
+
+public:
+  Proxy(ba::io_service &queue, const unsigned short port,
+        const ba::ip::tcp::endpoint &fallback_backend,
+        const bp::time_duration &session_timeout = bp::milliseconds(DEFAULT_SESSION_TIMEOUT))
+      : acceptor_(queue, ba::ip::tcp::endpoint(ba::ip::tcp::v4(), port)),
+        routes_(fallback_backend), session_timeout_(session_timeout),
+        max_attachment_size_(DEFAULT_MAX_ATTACHMENT_SIZE) {
+    std::cout << "Started a proxy at " << acceptor_.local_endpoint() << std::endl;
+    startAccept();
+  }
+
+  virtual ~Proxy() {}
+
+  // forward RPCs of the method index to the backend instead of the fallback backend.
+  // applied to sessions accepted from now on.
+  void setRoute(const int method_index, const ba::ip::tcp::endpoint &backend) {
+    routes_.routes[method_index] = backend;
+  }
+
+  // fail RPCs whose request or response attachment is larger than the size.
+  // applied to sessions accepted from now on.
+  void setMaxAttachmentSize(const std::size_t size) { max_attachment_size_ = size; }
+
+private:
+  void startAccept() {
+    const boost::shared_ptr< ProxySession > session(boost::make_shared< ProxySession >(
+        boost::ref(acceptor_.get_io_service()), boost::cref(routes_), session_timeout_));
+    acceptor_.async_accept(session->socket_,
+                           boost::bind(&Proxy::handleAccept, this, session, _1));
+  }
+
+  void handleAccept(const boost::shared_ptr< ProxySession > &session,
+                    const bs::error_code &error) {
+    if (error) {
+      std::cerr << "Error on accepting: " << error.message() << std::endl;
+      startAccept();
+      return;
+    }
+    session->routes_ = routes_;
+    session->max_attachment_size_ = max_attachment_size_;
+    session->start();
+    startAccept();
+  }
+
+private:
+  ba::ip::tcp::acceptor acceptor_;
+  ProxyRoutes routes_;
+  const bp::time_duration session_timeout_;
+  std::size_t max_attachment_size_;
+};
+}
+
+#endif // PROTO_RPC_PROXY
\ No newline at end of file
@@ -1,42 +1,71 @@
 #ifndef PROTO_RPC_SERVER
 #define PROTO_RPC_SERVER
 
+#include <algorithm> // for min, remove_if
+#include <cstring>   // for memcpy
 #include <iostream>
+#include <string>
+#include <vector>
 
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/error.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
 #include <boost/asio/read_until.hpp>
 #include <boost/asio/streambuf.hpp>
 #include <boost/asio/write.hpp>
+#include <boost/atomic.hpp>
 #include <boost/bind.hpp>
 #include <boost/date_time/posix_time/posix_time_duration.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/make_shared.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/system/error_code.hpp>
+#include <boost/weak_ptr.hpp>
 
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/message.h>
 #include <google/protobuf/service.h>
 
+#include <proto_rpc/capture.hpp>
 #include <proto_rpc/controller.hpp>
+#include <proto_rpc/handoff.hpp>
 #include <proto_rpc/message_coding.hpp>
 #include <proto_rpc/messages.hpp>
 #include <proto_rpc/namespace.hpp>
+#include <proto_rpc/tracing.hpp>
 
 namespace proto_rpc {
 
+// interface for a service which also handles serialized requests and responses. a session calls
+// CallMethodRaw() instead of CallMethod() if the service implements this, so that no request and
+// response messages are instantiated, parsed or serialized on the server.
+class RawService {
+public:
+  virtual ~RawService() {}
+
+  virtual void CallMethodRaw(const gp::MethodDescriptor *method, Controller *controller,
+                             const std::string &request, std::string *response) = 0;
+};
+
 class Session : public boost::enable_shared_from_this< Session > {
   friend class Server;
 
 public:
   Session(ba::io_service &queue, const boost::shared_ptr< gp::Service > &service,
           const bp::time_duration &timeout)
-      : socket_(queue), timer_(queue), service_(service), timeout_(timeout) {}
+      : socket_(queue), timer_(queue), drain_timer_(queue), service_(service),
+        raw_service_(dynamic_cast< RawService * >(service.get())), timeout_(timeout),
+        tracing_(false), capture_connection_(0),
+        one_way_failures_(boost::make_shared< boost::atomic< std::size_t > >(0)),
+        max_attachment_size_(0), request_attachment_capacity_(0), idle_(false),
+        draining_(false) {}
 
   virtual ~Session() { std::cout << "Session " << this << ": Closed" << std::endl; }
 
@@ -46,6 +75,24 @@ public:
   }
 
 private:
+  // close this session gracefully. an idle session is closed immediately, and a busy session is
+  // closed after the current RPC, or forcibly at the deadline given by the timeout.
+  // called by a handler in the queue like other steps of this session, so that it does not race
+  // with them (a queue running on multiple threads is not supported).
+  void drain(const bp::time_duration &timeout) {
+    draining_ = true;
+
+    // the expiration handler does not keep this session alive
+    drain_timer_.expires_from_now(timeout);
+    drain_timer_.async_wait(boost::bind(&Session::handleDrainExpire,
+                                        boost::weak_ptr< Session >(shared_from_this()), _1));
+
+    // wake the idle session up. the read handler will start closing.
+    if (idle_) {
+      socket_.cancel();
+    }
+  }
+
   // common elements of the following data types
   struct CommonData {
     CommonData() { info.set_failed(false); }
@@ -63,7 +110,6 @@ private:
 
     FailureInfo info;
 
-    ba::streambuf read_buffer;
     ba::streambuf write_buffer;
   };
 
@@ -78,7 +124,7 @@ private:
 
   // data used in a single RPC
   struct RpcData : CommonData {
-    RpcData() : method(NULL) {}
+    RpcData() : method(NULL), raw(false), close_session(false) {}
 
     virtual ~RpcData() {}
 
@@ -86,6 +132,17 @@ private:
     MethodIndex index;
     boost::scoped_ptr< gp::Message > request;
     boost::scoped_ptr< gp::Message > response;
+    Controller controller; // also holds the attachments
+
+    // serialized request and response used instead of messages for a raw service
+    bool raw;
+    std::string raw_request;
+    std::string raw_response;
+
+    TraceRecord trace;
+
+    // the session is closed after this RPC because the rest of the request is left unread
+    bool close_session;
   };
 
 private:
@@ -106,7 +163,7 @@ private:
 
     // start reading the socket. the receive handler will cancel the timeout.
     ba::async_read_until(
-        socket_, data->read_buffer, Decode(data->descriptor),
+        socket_, read_buffer_, Decode(data->descriptor),
         boost::bind(&Session::handleReadServiceDescriptor, this, data, _1, _2, shared_from_this()));
   }
 
@@ -123,7 +180,7 @@ private:
     }
 
     // clear the buffer corresponding the received descriptor
-    data->read_buffer.consume(bytes);
+    read_buffer_.consume(bytes);
 
     // check if the server-side service is valid
     if (!service_) {
@@ -175,7 +232,7 @@ private:
 
     // start the first RPC if the authorization is ok
     if (!data->info.failed()) {
-      startReadMethodIndex();
+      startNextRpc();
     }
 
     // end of the initial authorization. the authorization data is destructed here.
@@ -183,29 +240,48 @@ private:
 
   /*
   * RPC steps
-  *   1. read the index of a method to be called (go 2a if the index is valid, or 2b)
-  *   2a. read a request of the method (go 3 if the request is valid, or 4)
-  *   2b. consume a request of the method (go 4)
-  *   3. call the method with the request
-  *   4. write the result of this RPC
-  *   5. start the next RPC
+  *   1. read the index of a method to be called (go 2a if the index is valid, 2b if not, or 5 if
+  *      the request attachment is too large)
+  *   2a. read a request of the method (go 3)
+  *   2b. consume a request of the method (go 3)
+  *   3. read an attachment of the request if any (go 4 if the index and the request are valid,
+  *      or 5)
+  *   4. call the method with the request
+  *   5. write the result of this RPC and an attachment of the response if any,
+  *      or only count the failure if the RPC is one-way
+  *   6. start the next RPC, or start closing on drain or after a too large attachment
   */
 
+  void startNextRpc() {
+    // close this session on drain unless following requests have been received
+    if (draining_ && read_buffer_.size() == 0) {
+      startWriteClosing();
+      return;
+    }
+    startReadMethodIndex();
+  }
+
   void startReadMethodIndex() {
     // starting point of a RPC. prepare data for this RPC.
     const boost::shared_ptr< RpcData > data(boost::make_shared< RpcData >());
 
     // wait the first data or disconnection from the client without timeout
+    idle_ = true;
     ba::async_read_until(
-        socket_, data->read_buffer, Decode(data->index),
+        socket_, read_buffer_, Decode(data->index),
         boost::bind(&Session::handleReadMethodIndex, this, data, _1, _2, shared_from_this()));
   }
 
   void handleReadMethodIndex(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
                              const std::size_t bytes,
                              const boost::shared_ptr< Session > & /*tracked_this_ptr*/) {
+    idle_ = false;
+
     if (error == ba::error::eof) { // disconnected by the client
       return;
+    } else if (error == ba::error::operation_aborted && draining_) { // woken up on drain
+      startWriteClosing();
+      return;
     } else if (error) {
       std::cerr << "Session " << this << ": Error on reading method index: " << error.message()
                 << std::endl;
@@ -213,7 +289,22 @@ private:
     }
 
     // clear the buffer corresponding the received index
-    data->read_buffer.consume(bytes);
+    read_buffer_.consume(bytes);
+
+    if (tracing_) {
+      data->trace.stamp(TraceRecord::SERVER_INDEX_READ);
+      data->trace.trace_id = data->index.trace_id();
+      data->trace.span_id = data->index.span_id();
+      data->trace.method_index = data->index.value();
+    }
+
+    // reject a too large attachment before allocating it
+    if (data->index.attachment_size() > max_attachment_size_) {
+      data->setFailed("Too large request attachment on server");
+      data->close_session = true;
+      startWriteRpcResult(data);
+      return;
+    }
 
     // check if the received method index is valid
     if (!data->index.IsInitialized()) {
@@ -234,13 +325,21 @@ private:
   }
 
   void startReadRequest(const boost::shared_ptr< RpcData > &data) {
-    data->request.reset(service_->GetRequestPrototype(data->method).New());
-
     timer_.expires_from_now(timeout_);
     timer_.async_wait(boost::bind(&Session::handleExpire, this, _1, shared_from_this()));
 
+    // a raw service takes the serialized request as is
+    if (raw_service_) {
+      data->raw = true;
+      ba::async_read_until(
+          socket_, read_buffer_, DecodeRaw(&data->raw_request),
+          boost::bind(&Session::handleReadRequest, this, data, _1, _2, shared_from_this()));
+      return;
+    }
+
+    data->request.reset(service_->GetRequestPrototype(data->method).New());
     ba::async_read_until(
-        socket_, data->read_buffer, Decode(*data->request),
+        socket_, read_buffer_, Decode(*data->request),
         boost::bind(&Session::handleReadRequest, this, data, _1, _2, shared_from_this()));
   }
 
@@ -256,16 +355,10 @@ private:
     }
 
     // clear the range corresponding the parsed request
-    data->read_buffer.consume(bytes);
-
-    // check if the request is valid
-    if (!data->request->IsInitialized()) {
-      data->setFailed("Uninitialized request on server");
-      startWriteRpcResult(data);
-      return;
-    }
+    captureRequest(data, bytes);
+    read_buffer_.consume(bytes);
 
-    callMethod(data);
+    startReadRequestAttachment(data);
   }
 
   void startConsumeRequest(const boost::shared_ptr< RpcData > &data) {
@@ -275,7 +368,7 @@ private:
     timer_.async_wait(boost::bind(&Session::handleExpire, this, _1, shared_from_this()));
 
     ba::async_read_until(
-        socket_, data->read_buffer, Decode(*data->request),
+        socket_, read_buffer_, Decode(*data->request),
         boost::bind(&Session::handleConsumeRequest, this, data, _1, _2, shared_from_this()));
   }
 
@@ -291,17 +384,106 @@ private:
     }
 
     // clear the range corresponding the received request
-    data->read_buffer.consume(bytes);
+    captureRequest(data, bytes);
+    read_buffer_.consume(bytes);
 
-    startWriteRpcResult(data);
+    startReadRequestAttachment(data);
+  }
+
+  void startReadRequestAttachment(const boost::shared_ptr< RpcData > &data) {
+    const std::size_t size(data->index.attachment_size());
+    if (size == 0) {
+      handleReadRequestAttachment(data, bs::error_code(), shared_from_this());
+      return;
+    }
+
+    // receive into the buffer of this session, which is reused over RPCs and is grown without
+    // initialization
+    if (request_attachment_capacity_ < size) {
+      request_attachment_buffer_.reset(new char[size]);
+      request_attachment_capacity_ = size;
+    }
+    char *const attachment(data->controller.allocateRequestAttachment(
+        size, request_attachment_buffer_.get(), request_attachment_capacity_));
+
+    // take bytes of the attachment already in the buffer
+    const std::size_t buffered(std::min(read_buffer_.size(), size));
+    std::memcpy(attachment, ba::buffer_cast< const char * >(read_buffer_.data()), buffered);
+    read_buffer_.consume(buffered);
+    if (buffered == size) {
+      handleReadRequestAttachment(data, bs::error_code(), shared_from_this());
+      return;
+    }
+
+    // read the rest directly into the attachment
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&Session::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_read(socket_, ba::buffer(attachment + buffered, size - buffered),
+                   boost::bind(&Session::handleReadRequestAttachment, this, data, _1,
+                               shared_from_this()));
+  }
+
+  void handleReadRequestAttachment(const boost::shared_ptr< RpcData > &data,
+                                   const bs::error_code &error,
+                                   const boost::shared_ptr< Session > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "Session " << this << ": Error on reading request attachment: "
+                << error.message() << std::endl;
+      return;
+    }
+
+    // the request has been consumed because of an invalid method index
+    if (data->info.failed()) {
+      startWriteRpcResult(data);
+      return;
+    }
+
+    if (tracing_) {
+      data->trace.stamp(TraceRecord::SERVER_REQUEST_READ);
+    }
+
+    // check if the request is valid. a serialized request is not checked.
+    if (!data->raw && !data->request->IsInitialized()) {
+      data->setFailed("Uninitialized request on server");
+      startWriteRpcResult(data);
+      return;
+    }
+
+    callMethod(data);
+  }
+
+  void captureRequest(const boost::shared_ptr< RpcData > &data, const std::size_t bytes) {
+    // append the encoded request at the front of the buffer to the capture file if enabled
+    if (capture_) {
+      capture_->append(capture_connection_,
+                       data->index.IsInitialized() ? data->index.value() : -1,
+                       data->index.one_way(), data->index.attachment_size(),
+                       ba::buffer_cast< const char * >(read_buffer_.data()), bytes);
+    }
   }
 
   void callMethod(const boost::shared_ptr< RpcData > &data) {
-    // call the method
-    Controller controller;
-    data->response.reset(service_->GetResponsePrototype(data->method).New());
-    service_->CallMethod(data->method, &controller, data->request.get(), data->response.get(),
-                         gp::NewCallback(&gp::DoNothing));
+    // call the method with the trace ids from the client
+    Controller &controller(data->controller);
+    controller.SetTraceId(data->index.trace_id());
+    controller.SetSpanId(data->index.span_id());
+    if (tracing_) {
+      data->trace.stamp(TraceRecord::SERVER_CALL_START);
+    }
+    if (data->raw) {
+      raw_service_->CallMethodRaw(data->method, &controller, data->raw_request,
+                                  &data->raw_response);
+    } else {
+      data->response.reset(service_->GetResponsePrototype(data->method).New());
+      service_->CallMethod(data->method, &controller, data->request.get(), data->response.get(),
+                           gp::NewCallback(&gp::DoNothing));
+    }
+    if (tracing_) {
+      data->trace.stamp(TraceRecord::SERVER_CALL_END);
+    }
 
     // check if the call is succeeded
     if (controller.Failed()) {
@@ -310,8 +492,8 @@ private:
       return;
     }
 
-    // check if the call returned a valid response
-    if (!data->response->IsInitialized()) {
+    // check if the call returned a valid response. a serialized response is not checked.
+    if (!data->raw && !data->response->IsInitialized()) {
       data->setFailed("Uninitialized response on server");
       startWriteRpcResult(data);
       return;
@@ -321,38 +503,139 @@ private:
   }
 
   void startWriteRpcResult(const boost::shared_ptr< RpcData > &data) {
-    // ensure the response exists
-    if (!data->response) {
+    // a one-way RPC has no result to be written
+    if (data->index.one_way()) {
+      if (data->info.failed()) {
+        ++*one_way_failures_;
+      }
+      if (tracing_) {
+        data->trace.failed = data->info.failed();
+        TraceBuffer::local().push(data->trace);
+      }
+      if (data->close_session) {
+        startWriteClosing();
+      } else {
+        startNextRpc();
+      }
+      return;
+    }
+
+    // ensure the response exists. an empty serialized response is equivalent to a placeholder.
+    if (data->raw && data->info.failed()) {
+      data->raw_response.clear();
+    } else if (!data->raw && !data->response) {
       data->response.reset(new Placeholder());
     }
 
+    // attach the response attachment only to a succeeded result
+    ba::const_buffer attachment;
+    if (!data->info.failed() && data->controller.ResponseAttachmentSize() > 0) {
+      attachment = ba::buffer(data->controller.ResponseAttachment(),
+                              data->controller.ResponseAttachmentSize());
+      data->info.set_attachment_size(data->controller.ResponseAttachmentSize());
+    }
+
     // encode the failure info and the response
     encode(data->info, data->write_buffer);
-    encode(*data->response, data->write_buffer);
+    if (data->raw) {
+      encode(data->raw_response, data->write_buffer);
+    } else {
+      encode(*data->response, data->write_buffer);
+    }
 
     timer_.expires_from_now(timeout_);
     timer_.async_wait(boost::bind(&Session::handleExpire, this, _1, shared_from_this()));
 
-    ba::async_write(socket_, data->write_buffer, boost::bind(&Session::handleWriteRpcResult, this,
-                                                             data, _1, shared_from_this()));
+    // gather the encoded messages and the attachment without copying the attachment
+    const boost::array< ba::const_buffer, 2 > buffers = {{data->write_buffer.data(), attachment}};
+    ba::async_write(socket_, buffers, boost::bind(&Session::handleWriteRpcResult, this, data, _1,
+                                                  shared_from_this()));
   }
 
-  void handleWriteRpcResult(const boost::shared_ptr< RpcData > &, const bs::error_code &error,
+  void handleWriteRpcResult(const boost::shared_ptr< RpcData > &data, const bs::error_code &error,
                             const boost::shared_ptr< Session > & /*tracked_this_ptr*/) {
     timer_.cancel();
 
+    if (tracing_) {
+      data->trace.stamp(TraceRecord::SERVER_WRITE_COMPLETE);
+      data->trace.failed = error || data->info.failed();
+      TraceBuffer::local().push(data->trace);
+    }
+
     if (error) {
       std::cerr << "Session " << this << ": Error on writing RPC result: " << error.message()
                 << std::endl;
       return;
     }
 
+    // close this session without reading the rest of the request
+    if (data->close_session) {
+      startWriteClosing();
+      return;
+    }
+
     // start the next RPC
-    startReadMethodIndex();
+    startNextRpc();
 
     // end of this RPC. the data is destructed here.
   }
 
+  /*
+  * closing steps on drain or after a too large attachment
+  *   1. write a closing failure info, which tells the client that the following request has not
+  *      been processed and can be sent again on a new connection
+  *   2. shut down sending and discard data from the client until it disconnects, so that
+  *      the info is not lost by a reset on closing with unread data
+  */
+
+  void startWriteClosing() {
+    const boost::shared_ptr< CommonData > data(boost::make_shared< CommonData >());
+    data->setFailed("Session closed by server");
+    data->info.set_closing(true);
+    encode(data->info, data->write_buffer);
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&Session::handleExpire, this, _1, shared_from_this()));
+
+    ba::async_write(socket_, data->write_buffer, boost::bind(&Session::handleWriteClosing, this,
+                                                             data, _1, shared_from_this()));
+  }
+
+  void handleWriteClosing(const boost::shared_ptr< CommonData > & /*data*/,
+                          const bs::error_code &error,
+                          const boost::shared_ptr< Session > & /*tracked_this_ptr*/) {
+    timer_.cancel();
+
+    if (error) {
+      std::cerr << "Session " << this << ": Error on writing closing info: " << error.message()
+                << std::endl;
+      return;
+    }
+
+    bs::error_code ignored;
+    socket_.shutdown(ba::ip::tcp::socket::shutdown_send, ignored);
+
+    timer_.expires_from_now(timeout_);
+    timer_.async_wait(boost::bind(&Session::handleExpire, this, _1, shared_from_this()));
+    startDiscard();
+  }
+
+  void startDiscard() {
+    // the same range is reused as the data is never committed
+    socket_.async_read_some(read_buffer_.prepare(DISCARD_SIZE),
+                            boost::bind(&Session::handleDiscard, this, _1, shared_from_this()));
+  }
+
+  void handleDiscard(const bs::error_code &error,
+                     const boost::shared_ptr< Session > & /*tracked_this_ptr*/) {
+    // end of this session on the disconnection, the timeout or any error
+    if (error) {
+      timer_.cancel();
+      return;
+    }
+    startDiscard();
+  }
+
   void handleExpire(const bs::error_code &error,
                     const boost::shared_ptr< Session > & /*tracked_this_ptr*/) {
     if (error == ba::error::operation_aborted) { // timeout is canceled
@@ -366,29 +649,108 @@ private:
     socket_.cancel();
   }
 
+  static void handleDrainExpire(const boost::weak_ptr< Session > &weak_this,
+                                const bs::error_code &error) {
+    if (error == ba::error::operation_aborted) { // the session has been closed
+      return;
+    } else if (error) {
+      std::cerr << "Error on waiting drain expiration: " << error.message() << std::endl;
+      return;
+    }
+
+    // cancel the current RPC of the session still alive at the deadline
+    const boost::shared_ptr< Session > this_ptr(weak_this.lock());
+    if (this_ptr) {
+      std::cerr << "Session " << this_ptr.get() << ": Reached the drain deadline" << std::endl;
+      this_ptr->socket_.cancel();
+    }
+  }
+
 private:
+  enum { DISCARD_SIZE = 4096 };
+
   ba::ip::tcp::socket socket_;
   ba::deadline_timer timer_;
+  ba::deadline_timer drain_timer_;
+  // kept over RPCs because it may contain bytes of following one-way RPCs
+  ba::streambuf read_buffer_;
   const boost::shared_ptr< gp::Service > service_;
+  RawService *const raw_service_;
   const bp::time_duration timeout_;
+  bool tracing_;
+  boost::shared_ptr< CaptureFile > capture_;
+  gp::uint64 capture_connection_;
+  boost::shared_ptr< boost::atomic< std::size_t > > one_way_failures_;
+  std::size_t max_attachment_size_;
+  boost::scoped_array< char > request_attachment_buffer_;
+  std::size_t request_attachment_capacity_;
+  bool idle_;     // waiting a method index
+  bool draining_; // set by the server
 };
 
 class Server {
 public:
-  enum { DEFAULT_SESSION_TIMEOUT = 5000 };
+  enum { DEFAULT_SESSION_TIMEOUT = 5000, DEFAULT_MAX_ATTACHMENT_SIZE = 256 * 1024 * 1024 };
 
 public:
   Server(ba::io_service &queue, const unsigned short port,
          const boost::shared_ptr< gp::Service > &service,
          const bp::time_duration &session_timeout = bp::milliseconds(DEFAULT_SESSION_TIMEOUT))
       : acceptor_(queue, ba::ip::tcp::endpoint(ba::ip::tcp::v4(), port)), service_(service),
-        session_timeout_(session_timeout) {
+        session_timeout_(session_timeout), tracing_(false),
+        one_way_failures_(boost::make_shared< boost::atomic< std::size_t > >(0)),
+        max_attachment_size_(DEFAULT_MAX_ATTACHMENT_SIZE), draining_(false) {
     std::cout << "Started a server at " << acceptor_.local_endpoint() << std::endl;
     startAccept();
   }
 
+  // start a server on a listening socket passed from a predecessor (see handoff.hpp)
+  Server(ba::io_service &queue, const Listener &listener,
+         const boost::shared_ptr< gp::Service > &service,
+         const bp::time_duration &session_timeout = bp::milliseconds(DEFAULT_SESSION_TIMEOUT))
+      : acceptor_(queue, ba::ip::tcp::v4(), listener.fd), service_(service),
+        session_timeout_(session_timeout), tracing_(false),
+        one_way_failures_(boost::make_shared< boost::atomic< std::size_t > >(0)),
+        max_attachment_size_(DEFAULT_MAX_ATTACHMENT_SIZE), draining_(false) {
+    std::cout << "Took over a server at " << acceptor_.local_endpoint() << std::endl;
+    startAccept();
+  }
+
   virtual ~Server() {}
 
+  // record stages of each RPC in sessions accepted from now on to TraceBuffer::local() of the
+  // thread running the queue
+  void setTracing(const bool tracing) { tracing_ = tracing; }
+
+  // append requests received by sessions accepted from now on to the capture file.
+  // give a null capture file to stop capturing.
+  void setCapture(const boost::shared_ptr< CaptureFile > &capture) { capture_ = capture; }
+
+  // fail a RPC whose request attachment is larger than this and close its session, in sessions
+  // accepted from now on
+  void setMaxAttachmentSize(const std::size_t size) { max_attachment_size_ = size; }
+
+  // number of failed one-way RPCs, whose failures cannot be reported to clients
+  std::size_t oneWayFailures() const { return *one_way_failures_; }
+
+  // stop accepting and close sessions gracefully. idle sessions are closed immediately, and busy
+  // sessions are closed after their current RPCs, or forcibly at the deadline given by the
+  // timeout. a Channel sends again a request rejected by a closing session on a new connection.
+  // the queue runs out of work of this server when all sessions are closed.
+  // this can be called from any thread because the drain is performed by a handler in the queue.
+  // like other handlers of this server, the handler refers to this server, which therefore must
+  // not be destroyed until the queue has run the handler (e.g. until the queue runs out of work).
+  void drain(const bp::time_duration &timeout) {
+    acceptor_.get_io_service().post(boost::bind(&Server::startDrain, this, timeout));
+  }
+
+  // pass the listening socket to a successor waiting in receiveListener() at the path, and then
+  // drain. the port keeps accepting by the successor. the same lifetime rule as drain() applies.
+  void handOff(const std::string &path, const bp::time_duration &timeout) {
+    sendListener(path, acceptor_.native_handle());
+    drain(timeout);
+  }
+
 private:
   void startAccept() {
     const boost::shared_ptr< Session > session(
@@ -397,19 +759,80 @@ private:
   }
 
   void handleAccept(const boost::shared_ptr< Session > &session, const bs::error_code &error) {
+    if (error == ba::error::operation_aborted) { // the acceptor has been closed
+      return;
+    }
+
     if (error) {
       std::cerr << "Error on accepting: " << error.message() << std::endl;
-      startAccept();
+    } else {
+      session->tracing_ = tracing_;
+      session->one_way_failures_ = one_way_failures_;
+      session->max_attachment_size_ = max_attachment_size_;
+      if (capture_) {
+        session->capture_ = capture_;
+        session->capture_connection_ = capture_->newConnection();
+      }
+      session->start();
+    }
+
+    // a session accepted just before the drain
+    if (draining_) {
+      if (!error) {
+        session->drain(drain_timeout_);
+      }
       return;
     }
-    session->start();
+
+    // remember the session to be drained, and forget closed sessions
+    if (!error) {
+      sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(),
+                                     boost::bind(&boost::weak_ptr< Session >::expired, _1)),
+                      sessions_.end());
+      sessions_.push_back(session);
+    }
+
     startAccept();
   }
 
+  void startDrain(const bp::time_duration &timeout) {
+    if (draining_) {
+      return;
+    }
+    draining_ = true;
+    drain_timeout_ = timeout;
+
+    // stop accepting. the pending accept will be aborted.
+    bs::error_code error;
+    acceptor_.close(error);
+    if (error) {
+      std::cerr << "Error on closing acceptor: " << error.message() << std::endl;
+    }
+
+    for (std::vector< boost::weak_ptr< Session > >::const_iterator session = sessions_.begin();
+         session != sessions_.end(); ++session) {
+      const boost::shared_ptr< Session > session_ptr(session->lock());
+      if (session_ptr) {
+        session_ptr->drain(timeout);
+      }
+    }
+    sessions_.clear();
+    std::cout << "Draining the server" << std::endl;
+  }
+
 private:
   ba::ip::tcp::acceptor acceptor_;
   const boost::shared_ptr< gp::Service > service_;
   const bp::time_duration session_timeout_;
+  bool tracing_;
+  boost::shared_ptr< CaptureFile > capture_;
+  const boost::shared_ptr< boost::atomic< std::size_t > > one_way_failures_;
+  std::size_t max_attachment_size_;
+
+  // accepted sessions and the drain state, which are touched only by handlers in the queue
+  std::vector< boost::weak_ptr< Session > > sessions_;
+  bool draining_;
+  bp::time_duration drain_timeout_;
 };
 }
 
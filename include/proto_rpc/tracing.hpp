@@ -0,0 +1,229 @@
+#ifndef PROTO_RPC_TRACING
+#define PROTO_RPC_TRACING
+
+#include <time.h>   // for clock_gettime
+#include <unistd.h> // for getpid
+
+#include <cstddef>
+#include <iomanip>
+#include <ostream>
+#include <vector>
+
+#include <boost/thread/tss.hpp> // for thread_specific_ptr
+
+#include <google/protobuf/stubs/common.h> // for uint64
+
+#include <proto_rpc/namespace.hpp>
+
+namespace proto_rpc {
+
+// monotonic time in nanoseconds. only differences between two values are meaningful.
+static inline gp::uint64 monotonicNanoseconds() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast< gp::uint64 >(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// timestamps of a single RPC seen from either the client or the server
+struct TraceRecord {
+  enum Stage {
+    // client-side stages in Channel
+    CLIENT_CALL_START,
+    CLIENT_REQUEST_WRITTEN,
+    CLIENT_RESULT_READ,
+    CLIENT_CALL_END,
+    // server-side stages in Session
+    SERVER_INDEX_READ,
+    SERVER_REQUEST_READ,
+    SERVER_CALL_START,
+    SERVER_CALL_END,
+    SERVER_WRITE_COMPLETE,
+    NUM_STAGES
+  };
+
+  TraceRecord() { clear(); }
+
+  void clear() {
+    trace_id = 0;
+    span_id = 0;
+    method_index = -1;
+    failed = false;
+    for (int i = 0; i < NUM_STAGES; ++i) {
+      stamps[i] = 0;
+    }
+  }
+
+  void stamp(const Stage stage) { stamps[stage] = monotonicNanoseconds(); }
+
+  bool reached(const Stage stage) const { return stamps[stage] != 0; }
+
+  bool isServer() const { return reached(SERVER_INDEX_READ); }
+
+  // name of the interval which ends at the given stage
+  static const char *intervalName(const Stage stage) {
+    static const char *const names[NUM_STAGES] = {
+        "",              "write request", "wait result", "check result", "",
+        "read request", "dispatch",      "call method", "write result"};
+    return names[stage];
+  }
+
+  gp::uint64 trace_id;
+  gp::uint64 span_id;
+  int method_index;
+  bool failed;
+  gp::uint64 stamps[NUM_STAGES]; // 0 if the stage has not been reached
+};
+
+// fixed-capacity ring of trace records. the oldest record is overwritten when full.
+class TraceBuffer {
+public:
+  enum { DEFAULT_CAPACITY = 4096 };
+
+public:
+  TraceBuffer(const std::size_t capacity = DEFAULT_CAPACITY)
+      : records_(capacity), next_(0), size_(0),
+        id_state_(monotonicNanoseconds() ^ reinterpret_cast< std::size_t >(this)) {}
+
+  virtual ~TraceBuffer() {}
+
+  // the buffer of the calling thread. Channel and Session push records here.
+  static TraceBuffer &local() {
+    static boost::thread_specific_ptr< TraceBuffer > buffer;
+    if (!buffer.get()) {
+      buffer.reset(new TraceBuffer());
+    }
+    return *buffer;
+  }
+
+  // drop all records and change the capacity
+  void resize(const std::size_t capacity) {
+    records_.assign(capacity, TraceRecord());
+    next_ = 0;
+    size_ = 0;
+  }
+
+  void clear() {
+    next_ = 0;
+    size_ = 0;
+  }
+
+  void push(const TraceRecord &record) {
+    if (records_.empty()) {
+      return;
+    }
+    records_[next_] = record;
+    next_ = (next_ + 1) % records_.size();
+    if (size_ < records_.size()) {
+      ++size_;
+    }
+  }
+
+  std::size_t size() const { return size_; }
+
+  // records from the oldest to the newest
+  std::vector< TraceRecord > records() const {
+    std::vector< TraceRecord > records;
+    records.reserve(size_);
+    for (std::size_t i = 0; i < size_; ++i) {
+      records.push_back(records_[(next_ + records_.size() - size_ + i) % records_.size()]);
+    }
+    return records;
+  }
+
+  // a non-zero id for a new trace or span (splitmix64)
+  gp::uint64 newId() {
+    gp::uint64 id;
+    do {
+      id = (id_state_ += 0x9e3779b97f4a7c15ULL);
+      id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      id = (id ^ (id >> 27)) * 0x94d049bb133111ebULL;
+      id = id ^ (id >> 31);
+    } while (id == 0);
+    return id;
+  }
+
+  // write the records as a JSON array in the Chrome trace event format, which is also accepted by
+  // Perfetto. client and server records of the same RPC are linked by flow events on the span id.
+  void writeChromeTrace(std::ostream &os) const {
+    const std::vector< TraceRecord > records(this->records());
+    const int pid(getpid());
+    const std::size_t tid(reinterpret_cast< std::size_t >(this) & 0xffffff);
+
+    os << "[";
+    bool first(true);
+    for (std::size_t i = 0; i < records.size(); ++i) {
+      const TraceRecord &record(records[i]);
+      const bool server(record.isServer());
+      const int begin(server ? TraceRecord::SERVER_INDEX_READ : TraceRecord::CLIENT_CALL_START);
+      const int end(server ? TraceRecord::NUM_STAGES : TraceRecord::SERVER_INDEX_READ);
+
+      // find the first and last reached stages
+      int front(-1), back(-1);
+      for (int s = begin; s < end; ++s) {
+        if (record.reached(static_cast< TraceRecord::Stage >(s))) {
+          if (front < 0) {
+            front = s;
+          }
+          back = s;
+        }
+      }
+      if (front < 0) {
+        continue;
+      }
+
+      // the whole RPC
+      writeEvent(os, first, "X", server ? "server" : "client", "rpc", record, pid, tid,
+                 record.stamps[front], record.stamps[back] - record.stamps[front]);
+      // the flow from the client to the server
+      writeEvent(os, first, server ? "f" : "s", "flow", "rpc", record, pid, tid,
+                 record.stamps[front], 0);
+
+      // intervals between the reached stages
+      for (int s = front + 1, prev = front; s <= back; ++s) {
+        const TraceRecord::Stage stage(static_cast< TraceRecord::Stage >(s));
+        if (!record.reached(stage)) {
+          continue;
+        }
+        writeEvent(os, first, "X", server ? "server" : "client", TraceRecord::intervalName(stage),
+                   record, pid, tid, record.stamps[prev], record.stamps[s] - record.stamps[prev]);
+        prev = s;
+      }
+    }
+    os << "]";
+  }
+
+private:
+  static void writeEvent(std::ostream &os, bool &first, const char *phase, const char *category,
+                         const char *name, const TraceRecord &record, const int pid,
+                         const std::size_t tid, const gp::uint64 ts, const gp::uint64 dur) {
+    if (!first) {
+      os << ",";
+    }
+    first = false;
+
+    const std::ios_base::fmtflags flags(os.flags());
+    const std::streamsize precision(os.precision());
+    os << std::fixed << std::setprecision(3);
+    os << "\n{\"ph\":\"" << phase << "\",\"cat\":\"" << category << "\",\"name\":\"" << name
+       << "\",\"pid\":" << pid << ",\"tid\":" << tid << ",\"ts\":" << ts / 1000.;
+    if (phase[0] == 'X') {
+      os << ",\"dur\":" << dur / 1000.;
+    } else {
+      os << ",\"id\":\"0x" << std::hex << record.span_id << std::dec << "\",\"bp\":\"e\"";
+    }
+    os << ",\"args\":{\"trace_id\":\"" << std::hex << record.trace_id << "\",\"span_id\":\""
+       << record.span_id << std::dec << "\",\"method_index\":" << record.method_index
+       << ",\"failed\":" << (record.failed ? "true" : "false") << "}}";
+    os.flags(flags);
+    os.precision(precision);
+  }
+
+private:
+  std::vector< TraceRecord > records_;
+  std::size_t next_;
+  std::size_t size_;
+  gp::uint64 id_state_;
+};
+}
+
+#endif // PROTO_RPC_TRACING
\ No newline at end of file
@@ -0,0 +1,372 @@
+// replays requests in a capture file (see capture.hpp) to a server
+//   usage: proto_rpc_replay <capture file> <address> <port> [speed] [connections]
+//     speed: 1 for the original timing, N for N times faster, 0 for no wait (default: 1)
+//     connections: 0 for the captured connections, N to deal requests over N connections in turn
+//       in the captured order (default: 0)
+//   request attachments are replayed as zero bytes of the captured sizes. response attachments
+//   are discarded.
+
+#include <algorithm> // for max, stable_sort
+#include <cstdlib>   // for atof, atoi
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <boost/array.hpp>
+#include <boost/asio/buffer.hpp>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/ref.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/system/error_code.hpp>
+
+#include <google/protobuf/descriptor.pb.h>
+
+#include <proto_rpc/capture.hpp>
+#include <proto_rpc/message_coding.hpp>
+#include <proto_rpc/messages.hpp>
+#include <proto_rpc/namespace.hpp>
+
+namespace proto_rpc {
+
+struct ReplayStats {
+  ReplayStats() : sent(0), one_way(0), succeeded(0), failed(0), errors(0) {}
+
+  std::size_t sent;
+  std::size_t one_way;
+  std::size_t succeeded;
+  std::size_t failed;
+  std::size_t errors;
+  bp::time_duration total_latency;
+  bp::time_duration max_latency;
+};
+
+// a client connection which sends captured requests in order
+class ReplayConnection : public boost::enable_shared_from_this< ReplayConnection > {
+public:
+  ReplayConnection(ba::io_service &queue, const ba::ip::tcp::endpoint &endpoint,
+                   const gp::ServiceDescriptorProto &descriptor,
+                   const std::vector< const CaptureRecord * > &records, const gp::uint64 origin,
+                   const bp::ptime &start, const double speed,
+                   const std::vector< char > &attachment, ReplayStats &stats)
+      : socket_(queue), timer_(queue), endpoint_(endpoint), descriptor_(descriptor),
+        records_(records), next_(0), origin_(origin), start_(start), speed_(speed),
+        attachment_(attachment), stats_(stats), attachment_remaining_(0) {}
+
+  virtual ~ReplayConnection() {}
+
+  void start() {
+    socket_.async_connect(endpoint_, boost::bind(&ReplayConnection::handleConnect, this, _1,
+                                                 shared_from_this()));
+  }
+
+private:
+  void handleConnect(const bs::error_code &error,
+                     const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on connecting: " << error.message() << std::endl;
+      stats_.errors += records_.size();
+      return;
+    }
+
+    // the initial authorization with the captured service descriptor
+    encode(descriptor_, write_buffer_);
+    ba::async_write(socket_, write_buffer_, boost::bind(&ReplayConnection::handleWriteDescriptor,
+                                                        this, _1, shared_from_this()));
+  }
+
+  void handleWriteDescriptor(const bs::error_code &error,
+                             const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on writing service descriptor: " << error.message() << std::endl;
+      stats_.errors += records_.size();
+      return;
+    }
+    ba::async_read_until(socket_, read_buffer_, Decode(info_),
+                         boost::bind(&ReplayConnection::handleReadAuthorizationResult, this, _1,
+                                     _2, shared_from_this()));
+  }
+
+  void handleReadAuthorizationResult(
+      const bs::error_code &error, const std::size_t bytes,
+      const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on reading authorization result: " << error.message() << std::endl;
+      stats_.errors += records_.size();
+      return;
+    }
+    read_buffer_.consume(bytes);
+    if (!info_.IsInitialized() || info_.failed()) {
+      std::cerr << "Authorization failed: " << info_.error_text() << std::endl;
+      stats_.errors += records_.size();
+      return;
+    }
+    startWait();
+  }
+
+  void startWait() {
+    if (next_ >= records_.size()) {
+      socket_.close();
+      return;
+    }
+
+    // wait until the captured time of the next request scaled by the speed
+    bp::ptime due(start_);
+    if (speed_ > 0.) {
+      due += bp::microseconds(
+          static_cast< long >((records_[next_]->timestamp - origin_) / 1000. / speed_));
+    }
+    timer_.expires_at(due);
+    timer_.async_wait(boost::bind(&ReplayConnection::handleWait, this, _1, shared_from_this()));
+  }
+
+  void handleWait(const bs::error_code &error,
+                  const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on waiting: " << error.message() << std::endl;
+      return;
+    }
+
+    // the method index, the request bytes as captured and an attachment of the captured size.
+    // an invalid index was captured as -1 and is sent as an uninitialized index.
+    const CaptureRecord &record(*records_[next_]);
+    {
+      MethodIndex index;
+      if (record.method_index >= 0) {
+        index.set_value(record.method_index);
+      }
+      if (record.attachment_size > 0) {
+        index.set_attachment_size(record.attachment_size);
+      }
+      if (record.one_way) {
+        index.set_one_way(true);
+      }
+      encode(index, write_buffer_);
+      std::ostream os(&write_buffer_);
+      os.write(record.request.data(), record.request.size());
+    }
+
+    sent_time_ = bp::microsec_clock::universal_time();
+    ++stats_.sent;
+    const boost::array< ba::const_buffer, 2 > buffers = {
+        {write_buffer_.data(), ba::buffer(attachment_, record.attachment_size)}};
+    ba::async_write(socket_, buffers, boost::bind(&ReplayConnection::handleWriteRequest, this, _1,
+                                                  shared_from_this()));
+  }
+
+  void handleWriteRequest(const bs::error_code &error,
+                          const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on writing request: " << error.message() << std::endl;
+      stats_.errors += records_.size() - next_;
+      return;
+    }
+    write_buffer_.consume(write_buffer_.size());
+
+    // no result will come for a one-way request
+    if (records_[next_]->one_way) {
+      ++stats_.one_way;
+      ++next_;
+      startWait();
+      return;
+    }
+
+    info_.Clear();
+    ba::async_read_until(socket_, read_buffer_, Decode(info_),
+                         boost::bind(&ReplayConnection::handleReadFailureInfo, this, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadFailureInfo(const bs::error_code &error, const std::size_t bytes,
+                             const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on reading failure info: " << error.message() << std::endl;
+      stats_.errors += records_.size() - next_;
+      return;
+    }
+    read_buffer_.consume(bytes);
+
+    // no response follows a closing info. the server has not processed the request.
+    if (info_.closing()) {
+      std::cerr << "Session closed by server: " << info_.error_text() << std::endl;
+      stats_.errors += records_.size() - next_;
+      return;
+    }
+
+    // the response is not inspected
+    ba::async_read_until(socket_, read_buffer_, Decode(response_),
+                         boost::bind(&ReplayConnection::handleReadResponse, this, _1, _2,
+                                     shared_from_this()));
+  }
+
+  void handleReadResponse(const bs::error_code &error, const std::size_t bytes,
+                          const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on reading response: " << error.message() << std::endl;
+      stats_.errors += records_.size() - next_;
+      return;
+    }
+    read_buffer_.consume(bytes);
+
+    // the response attachment is not inspected. discard the buffered part first, and then the
+    // rest on the socket.
+    attachment_remaining_ = info_.attachment_size();
+    const std::size_t buffered(std::min< gp::uint64 >(read_buffer_.size(), attachment_remaining_));
+    read_buffer_.consume(buffered);
+    attachment_remaining_ -= buffered;
+    startDiscardAttachment();
+  }
+
+  void startDiscardAttachment() {
+    if (attachment_remaining_ == 0) {
+      finishRpc();
+      return;
+    }
+
+    socket_.async_read_some(
+        ba::buffer(discard_buffer_, std::min< gp::uint64 >(attachment_remaining_, DISCARD_SIZE)),
+        boost::bind(&ReplayConnection::handleDiscardAttachment, this, _1, _2,
+                    shared_from_this()));
+  }
+
+  void handleDiscardAttachment(const bs::error_code &error, const std::size_t bytes,
+                               const boost::shared_ptr< ReplayConnection > & /*tracked_this_ptr*/) {
+    if (error) {
+      std::cerr << "Error on reading response attachment: " << error.message() << std::endl;
+      stats_.errors += records_.size() - next_;
+      return;
+    }
+    attachment_remaining_ -= bytes;
+    startDiscardAttachment();
+  }
+
+  void finishRpc() {
+    // update the stats
+    const bp::time_duration latency(bp::microsec_clock::universal_time() - sent_time_);
+    stats_.total_latency += latency;
+    if (latency > stats_.max_latency) {
+      stats_.max_latency = latency;
+    }
+    if (info_.IsInitialized() && !info_.failed()) {
+      ++stats_.succeeded;
+    } else {
+      ++stats_.failed;
+    }
+
+    ++next_;
+    startWait();
+  }
+
+private:
+  enum { DISCARD_SIZE = 4096 };
+
+  ba::ip::tcp::socket socket_;
+  ba::deadline_timer timer_;
+  const ba::ip::tcp::endpoint endpoint_;
+  const gp::ServiceDescriptorProto &descriptor_;
+  const std::vector< const CaptureRecord * > records_;
+  std::size_t next_;
+  const gp::uint64 origin_;
+  const bp::ptime start_;
+  const double speed_;
+  const std::vector< char > &attachment_; // zero bytes of the largest captured attachment
+  ReplayStats &stats_;
+
+  ba::streambuf read_buffer_;
+  ba::streambuf write_buffer_;
+  FailureInfo info_;
+  Placeholder response_;
+  gp::uint64 attachment_remaining_; // bytes of the response attachment not yet discarded
+  boost::array< char, DISCARD_SIZE > discard_buffer_;
+  bp::ptime sent_time_;
+};
+}
+
+int main(int argc, char *argv[]) {
+  namespace ba = boost::asio;
+  namespace bp = boost::posix_time;
+  namespace pr = proto_rpc;
+
+  if (argc < 4) {
+    std::cerr << "Usage: " << argv[0] << " <capture file> <address> <port> [speed] [connections]"
+              << std::endl;
+    return 1;
+  }
+  const double speed(argc > 4 ? std::atof(argv[4]) : 1.);
+  const int connections(argc > 5 ? std::atoi(argv[5]) : 0);
+
+  try {
+    // load the capture file
+    google::protobuf::ServiceDescriptorProto descriptor;
+    std::vector< pr::CaptureRecord > records;
+    pr::CaptureFile::read(argv[1], descriptor, records);
+    if (records.empty()) {
+      std::cerr << "No records in " << argv[1] << std::endl;
+      return 1;
+    }
+    std::cout << "Loaded " << records.size() << " records of " << descriptor.name() << std::endl;
+
+    // sort the records by timestamp, which may differ from the order in the file because
+    // sessions append concurrently
+    std::stable_sort(records.begin(), records.end(), pr::CaptureRecord::earlier);
+    const google::protobuf::uint64 origin(records.front().timestamp);
+
+    // zero bytes sent as attachments, which are not captured
+    google::protobuf::uint64 max_attachment_size(0);
+    for (std::size_t i = 0; i < records.size(); ++i) {
+      max_attachment_size = std::max(max_attachment_size, records[i].attachment_size);
+    }
+    const std::vector< char > attachment(max_attachment_size, '\0');
+
+    // group the records by connection, or deal them over the given number of connections in
+    // turn so that the load can be spread over more connections than captured
+    std::map< google::protobuf::uint64, std::vector< const pr::CaptureRecord * > > groups;
+    for (std::size_t i = 0; i < records.size(); ++i) {
+      const google::protobuf::uint64 connection(connections > 0 ? i % connections
+                                                                : records[i].connection);
+      groups[connection].push_back(&records[i]);
+    }
+
+    // start all connections and run until they finish
+    ba::io_service queue;
+    const ba::ip::tcp::endpoint endpoint(ba::ip::address::from_string(argv[2]),
+                                         std::atoi(argv[3]));
+    const bp::ptime start(bp::microsec_clock::universal_time());
+    pr::ReplayStats stats;
+    typedef std::map< google::protobuf::uint64, std::vector< const pr::CaptureRecord * > > Groups;
+    for (Groups::const_iterator group = groups.begin(); group != groups.end(); ++group) {
+      boost::make_shared< pr::ReplayConnection >(boost::ref(queue), endpoint, descriptor,
+                                                 group->second, origin, start, speed,
+                                                 boost::cref(attachment), boost::ref(stats))
+          ->start();
+    }
+    queue.run();
+
+    // report
+    const bp::time_duration elapsed(bp::microsec_clock::universal_time() - start);
+    std::cout << "Replayed " << stats.sent << " requests on " << groups.size()
+              << " connections in " << elapsed << std::endl;
+    std::cout << "  one-way: " << stats.one_way << ", succeeded: " << stats.succeeded
+              << ", failed: " << stats.failed << ", errors: " << stats.errors << std::endl;
+    if (stats.succeeded + stats.failed > 0) {
+      const int completed(stats.succeeded + stats.failed);
+      std::cout << "  latency mean: " << stats.total_latency / completed
+                << ", max: " << stats.max_latency << std::endl;
+    }
+  } catch (const std::exception &error) {
+    std::cerr << error.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
\ No newline at end of file